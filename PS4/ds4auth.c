@@ -5,7 +5,13 @@
  This tool is similar to the Ds4AuthTool.py from Frank Zhao,
  but it's written in C and it exhibits the asynchronous IO capabilities of the libusb.
 
- Compile: gcc -o ds4auth ds4auth.c -lusb-1.0
+ Compile: gcc -o ds4auth ds4auth.c eventloop.c -lusb-1.0
+ (add -DDS4AUTH_HEAP_COUNT to count the heap allocations made during the authentication, glibc only)
+ Run:
+ $ ./ds4auth
+ $ ./ds4auth -i 5 -b 2 -m 500 -e estimate
+ $ ./ds4auth -c cache -C 256
+ $ ./ds4auth -n 100 -o bench.csv
  */
 
 #define _GNU_SOURCE
@@ -19,13 +25,20 @@
 #include <err.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <poll.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <sched.h>
+#include <limits.h>
+#include <stddef.h>
 
 #include <libusb-1.0/libusb.h>
 
+#include "eventloop.h"
+
 #define VENDOR 0x054c
 #define PRODUCT 0x05c4
 
@@ -34,6 +47,17 @@
 #define CHALLENGES_NB 0x05
 #define RESPONSE_NB 0x12
 
+#define F2_INTERVAL 5 // ms
+#define F2_BACKOFF 1.5
+#define F2_MAX_INTERVAL 1000 // ms
+#define F2_MARGIN 90 // the first poll is sent at this percentage of the estimate
+#define ESTIMATE_WEIGHT 4 // the estimate moves by 1/ESTIMATE_WEIGHT of the error each run
+
+#define CACHE_MAGIC 0x34534443
+#define CACHE_VERSION 2
+#define CACHE_ENTRIES 64
+#define CACHE_PROBES 8 // slots probed for a key, the least recently used one is evicted on insert
+
 static unsigned char challenges[CHALLENGES_NB][MAX_DATA_LENGTH] = {
     { 0xf0, 0x01, 0x00, 0x00, 0x5f, 0x3b, 0x74, 0x00, 0xc0, 0xa0, 0xc4, 0xd5, 0xfe, 0x05, 0x17, 0x5a, 0x02, 0x41, 0xf2, 0xf3, 0x73, 0x4f, 0x88, 0x76, 0x56, 0xa5, 0xf4, 0x1e, 0xac, 0xc1, 0x29, 0x92, 0xbc, 0xa7, 0x3d, 0x80, 0xfc, 0x9c, 0x97, 0xf0, 0x56, 0xa5, 0x4f, 0xab, 0x5b, 0x44, 0xf7, 0x8d, 0xbd, 0xb6, 0x7d, 0x4b, 0x40, 0xca, 0x49, 0xd3, 0x85, 0xf7, 0xba, 0xff, 0x6b, 0xb0, 0x73, 0x41 },
     { 0xf0, 0x01, 0x01, 0x00, 0x21, 0x6b, 0x0d, 0x0d, 0x8d, 0x6f, 0x82, 0x2c, 0x48, 0x56, 0x79, 0xa7, 0x97, 0x0c, 0xf7, 0x1e, 0xc1, 0xab, 0xec, 0x19, 0x45, 0x3a, 0xbc, 0x95, 0x08, 0x4d, 0x43, 0x77, 0xf6, 0xdc, 0x43, 0x1c, 0x88, 0x26, 0x82, 0x35, 0x7b, 0xbf, 0xeb, 0xbb, 0x87, 0xd2, 0x1e, 0x40, 0xcd, 0x27, 0xed, 0xbf, 0x5c, 0xea, 0x8c, 0xea, 0x5c, 0xbe, 0x94, 0x81, 0xe4, 0x49, 0xdc, 0x18 },
@@ -42,18 +66,147 @@ static unsigned char challenges[CHALLENGES_NB][MAX_DATA_LENGTH] = {
     { 0xf0, 0x01, 0x04, 0x00, 0x49, 0xb1, 0x03, 0xfd, 0x06, 0x7d, 0x2f, 0x6f, 0xe6, 0x4e, 0x55, 0x6d, 0xe2, 0x9e, 0x68, 0x3a, 0x9b, 0x90, 0xd9, 0x7a, 0x79, 0x6c, 0x16, 0x66, 0x01, 0xd3, 0x95, 0x4f, 0xaf, 0xc5, 0x2f, 0x1f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xaa, 0xd0, 0xc0, 0x1a },
 };
 
-static enum
+#define MAX_DEVICES 16
+#define DEVICE_ID_LENGTH 32
+
+typedef enum
 {
   E_STEP_F0,
   E_STEP_F2,
   E_STEP_F1,
-  E_STEP_DONE
-} step = E_STEP_F0;
+  E_STEP_DONE,
+  E_STEP_FAILED
+} e_step;
+
+/*
+ * The controller computes the response after the last challenge,
+ * and the F2 report tells whether it is ready.
+ * Polls are driven by a timer in the event loop, starting a bit before the time it took
+ * in the previous runs, at the initial interval, then backing off up to the max interval.
+ */
+typedef struct
+{
+  int timer;
+  unsigned long long challenged; // us, completion of the last challenge
+  unsigned long long submitted; // us, submission of the pending poll
+  unsigned long long not_ready; // us, submission of the last poll that was not ready, 0 if none
+  unsigned long long interval; // us
+  unsigned int polls;
+} s_f2;
 
-static unsigned char count = 0;
+/*
+ * Latencies of an authentication, in benchmark mode.
+ */
+typedef struct
+{
+  unsigned int challenges[CHALLENGES_NB]; // us, from submission to completion
+  unsigned int polls;
+  unsigned int ready; // us, from the last challenge to the response being ready
+  unsigned int responses[RESPONSE_NB]; // us, from submission to completion
+  unsigned int total; // us
+} s_run;
+
+/*
+ * Each controller runs its own authentication, all in the same event loop.
+ */
+typedef struct
+{
+  libusb_device_handle* devh;
+  uint8_t bus;
+  uint8_t address;
+  char id[DEVICE_ID_LENGTH]; // serial number, or bus:address if the controller has none
+  int cached; // the responses were found in the cache
+  e_step step;
+  unsigned char count;
+  s_f2 f2;
+  unsigned char responses[RESPONSE_NB][MAX_DATA_LENGTH];
+  unsigned long long start; // us, first challenge submitted
+  unsigned long long ready; // us, F2 reported the response ready
+  unsigned long long end; // us, last response read
+  unsigned long long submitted; // us, submission of the transfer in flight
+  s_run* runs;
+  unsigned int run;
+} s_device;
+
+static s_device devices[MAX_DEVICES];
+static unsigned int nb_devices = 0;
+static unsigned int pending = 0;
+
+/*
+ * A device has a single transfer in flight, and the callback submits the next one
+ * before the completed one is released: two transfers per device are enough.
+ */
+#define POOL_SIZE (2 * MAX_DEVICES)
+
+static struct
+{
+  struct libusb_transfer* transfers[POOL_SIZE]; // free transfers
+  unsigned int free;
+  unsigned long long taken;
+  unsigned long long allocated; // allocations made because the pool was empty
+} pool;
+
+static unsigned char pool_buffers[POOL_SIZE][LIBUSB_CONTROL_SETUP_SIZE + MAX_DATA_LENGTH];
+
+#ifdef DS4AUTH_HEAP_COUNT
+/*
+ * Instrumentation build: counts the heap allocation calls made during the authentication,
+ * by this tool and by libusb. malloc, calloc and realloc are interposed, and forward to the glibc ones
+ * (the aligned allocation functions are not counted).
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static int heap_counting = 0;
+static unsigned long long heap_allocs = 0;
+
+void* malloc(size_t size)
+{
+  if(heap_counting)
+  {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+  }
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+  if(heap_counting)
+  {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+  }
+  return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+  if(heap_counting)
+  {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+  }
+  return __libc_realloc(ptr, size);
+}
+#endif
 
 static int debug = 0;
 
+static unsigned int f2_interval = F2_INTERVAL;
+static double f2_backoff = F2_BACKOFF;
+static unsigned int f2_max_interval = F2_MAX_INTERVAL;
+static char* estimate_file = NULL;
+static char* cache_file = NULL;
+static unsigned int cache_entries = CACHE_ENTRIES;
+static unsigned int bench_runs = 0;
+static char* bench_file = NULL;
+static int trace = 1;
+
+static struct
+{
+  unsigned long long ready; // us, time from the last challenge to the response being ready
+  unsigned int runs;
+} estimate;
+
 static volatile int done = 0;
 
 void terminate(int sig)
@@ -61,6 +214,447 @@ void terminate(int sig)
   done = 1;
 }
 
+static void usage()
+{
+  fprintf(stderr, "Usage: ds4auth [-i ms] [-b backoff] [-m ms] [-e filename] [-c filename [-C entries]] [-n runs [-o filename]]\n");
+  fprintf(stderr, "  -i: initial interval between F2 polls (default: %d)\n", F2_INTERVAL);
+  fprintf(stderr, "  -b: factor applied to the interval after each poll (default: %.1f)\n", F2_BACKOFF);
+  fprintf(stderr, "  -m: max interval between F2 polls (default: %d)\n", F2_MAX_INTERVAL);
+  fprintf(stderr, "  -e: file the readiness time estimate is kept in (default: ~/.ds4auth)\n");
+  fprintf(stderr, "  -c: per-controller challenge/response cache file (not used in benchmark mode)\n");
+  fprintf(stderr, "  -C: max number of cache entries, when the cache file is created (default: %d)\n", CACHE_ENTRIES);
+  fprintf(stderr, "  -n: benchmark mode, authenticate runs times and print the latencies of each phase\n");
+  fprintf(stderr, "  -o: write the latencies of each run to a csv file (default: stdout)\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads command-line arguments.
+ */
+static void read_args(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, ":i:b:m:e:c:C:n:o:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'i':
+        f2_interval = strtoul(optarg, NULL, 10);
+        if(!f2_interval)
+        {
+          usage();
+        }
+        break;
+      case 'b':
+        f2_backoff = strtod(optarg, NULL);
+        if(f2_backoff < 1)
+        {
+          usage();
+        }
+        break;
+      case 'm':
+        f2_max_interval = strtoul(optarg, NULL, 10);
+        if(!f2_max_interval)
+        {
+          usage();
+        }
+        break;
+      case 'e':
+        estimate_file = optarg;
+        break;
+      case 'c':
+        cache_file = optarg;
+        break;
+      case 'C':
+        cache_entries = strtoul(optarg, NULL, 10);
+        if(!cache_entries)
+        {
+          usage();
+        }
+        break;
+      case 'n':
+        bench_runs = strtoul(optarg, NULL, 10);
+        if(!bench_runs)
+        {
+          usage();
+        }
+        trace = 0;
+        break;
+      case 'o':
+        bench_file = optarg;
+        break;
+      default: /* '?' */
+        usage();
+        break;
+    }
+  }
+
+  if(f2_max_interval < f2_interval)
+  {
+    f2_max_interval = f2_interval;
+  }
+}
+
+static unsigned long long now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void estimate_load()
+{
+  FILE* file = fopen(estimate_file, "r");
+  if(!file)
+  {
+    return;
+  }
+  if(fscanf(file, "%llu %u", &estimate.ready, &estimate.runs) != 2)
+  {
+    estimate.ready = 0;
+    estimate.runs = 0;
+  }
+  fclose(file);
+  if(estimate.runs)
+  {
+    printf("readiness estimate: %.1f ms (%u run(s))\n", estimate.ready / 1000.0, estimate.runs);
+  }
+}
+
+static void estimate_save()
+{
+  FILE* file = fopen(estimate_file, "w");
+  if(!file)
+  {
+    fprintf(stderr, "can't open %s: %s\n", estimate_file, strerror(errno));
+    return;
+  }
+  fprintf(file, "%llu %u\n", estimate.ready, estimate.runs);
+  fclose(file);
+}
+
+/*
+ * The response got ready between the last poll that was not ready and the one that was.
+ */
+static void estimate_update(s_device* device)
+{
+  s_f2* f2 = &device->f2;
+  unsigned long long ready = f2->submitted - f2->challenged;
+  unsigned long long measured = ready;
+  if(f2->not_ready)
+  {
+    measured = (f2->not_ready - f2->challenged + ready) / 2;
+  }
+
+  if(trace)
+  {
+    printf("(%03u:%03u) response ready after %.1f ms (%u poll(s))\n", device->bus, device->address,
+        ready / 1000.0, f2->polls);
+  }
+
+  if(!estimate.runs)
+  {
+    estimate.ready = measured;
+  }
+  else
+  {
+    estimate.ready = ((ESTIMATE_WEIGHT - 1) * estimate.ready + measured) / ESTIMATE_WEIGHT;
+  }
+  ++estimate.runs;
+}
+
+/*
+ * The responses to a set of challenges are kept in a file mapped in memory,
+ * in an open-addressed table keyed by a hash of the controller and of the challenges:
+ * the responses depend on the key and certificate of each controller.
+ */
+typedef struct
+{
+  uint64_t key; // 0 if the slot is empty
+  uint64_t used; // value of the cache clock at the last access
+  char device[DEVICE_ID_LENGTH];
+  unsigned char challenges[CHALLENGES_NB][MAX_DATA_LENGTH];
+  unsigned char responses[RESPONSE_NB][MAX_DATA_LENGTH];
+} s_cache_slot;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t count;
+  uint64_t clock;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  s_cache_slot slot[];
+} s_cache;
+
+static s_cache* cache = NULL;
+static size_t cache_size = 0;
+
+static uint64_t fnv1a(uint64_t hash, const unsigned char* bytes, size_t length)
+{
+  size_t i;
+  for(i=0; i<length; ++i)
+  {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t cache_key(const char* device, unsigned char challenges[CHALLENGES_NB][MAX_DATA_LENGTH])
+{
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, (const unsigned char*)device, strlen(device));
+  hash = fnv1a(hash, (const unsigned char*)challenges, CHALLENGES_NB * MAX_DATA_LENGTH);
+  return hash ? hash : 1;
+}
+
+static int cache_match(s_cache_slot* slot, uint64_t key, const char* device, unsigned char challenges[CHALLENGES_NB][MAX_DATA_LENGTH])
+{
+  return slot->key == key && !strcmp(slot->device, device) && !memcmp(slot->challenges, challenges, sizeof(slot->challenges));
+}
+
+static int cache_open()
+{
+  int fd = open(cache_file, O_RDWR | O_CREAT, 0644);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open %s: %s\n", cache_file, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0)
+  {
+    fprintf(stderr, "can't stat %s: %s\n", cache_file, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  int created = 0;
+  if(!st.st_size)
+  {
+    st.st_size = sizeof(s_cache) + cache_entries * sizeof(s_cache_slot);
+    if(ftruncate(fd, st.st_size) < 0)
+    {
+      fprintf(stderr, "can't resize %s: %s\n", cache_file, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    created = 1;
+  }
+
+  if(st.st_size < sizeof(s_cache))
+  {
+    fprintf(stderr, "bad cache file %s\n", cache_file);
+    close(fd);
+    return -1;
+  }
+
+  cache = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(cache == MAP_FAILED)
+  {
+    fprintf(stderr, "can't map %s: %s\n", cache_file, strerror(errno));
+    cache = NULL;
+    return -1;
+  }
+  cache_size = st.st_size;
+
+  if(created)
+  {
+    cache->magic = CACHE_MAGIC;
+    cache->version = CACHE_VERSION;
+    cache->slots = cache_entries;
+  }
+  else if(cache->magic != CACHE_MAGIC || cache->version != CACHE_VERSION || !cache->slots
+      || sizeof(s_cache) + cache->slots * sizeof(s_cache_slot) > cache_size)
+  {
+    fprintf(stderr, "bad cache file %s\n", cache_file);
+    munmap(cache, cache_size);
+    cache = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void cache_close()
+{
+  if(cache)
+  {
+    printf("cache: %u/%u entries, %llu hit(s), %llu miss(es), %llu eviction(s)\n", cache->count, cache->slots,
+        (unsigned long long)cache->hits, (unsigned long long)cache->misses, (unsigned long long)cache->evictions);
+    munmap(cache, cache_size);
+    cache = NULL;
+  }
+}
+
+static s_cache_slot* cache_lookup(const char* device, unsigned char challenges[CHALLENGES_NB][MAX_DATA_LENGTH])
+{
+  uint64_t key = cache_key(device, challenges);
+  unsigned int i;
+
+  for(i=0; i<CACHE_PROBES && i<cache->slots; ++i)
+  {
+    s_cache_slot* slot = cache->slot + (key + i) % cache->slots;
+    if(!slot->key)
+    {
+      break;
+    }
+    if(cache_match(slot, key, device, challenges))
+    {
+      slot->used = ++cache->clock;
+      ++cache->hits;
+      return slot;
+    }
+  }
+
+  ++cache->misses;
+  return NULL;
+}
+
+static void cache_store(const char* device, unsigned char challenges[CHALLENGES_NB][MAX_DATA_LENGTH],
+    unsigned char responses[RESPONSE_NB][MAX_DATA_LENGTH])
+{
+  uint64_t key = cache_key(device, challenges);
+  s_cache_slot* victim = NULL;
+  unsigned int i;
+
+  for(i=0; i<CACHE_PROBES && i<cache->slots; ++i)
+  {
+    s_cache_slot* slot = cache->slot + (key + i) % cache->slots;
+    if(!slot->key || cache_match(slot, key, device, challenges))
+    {
+      victim = slot;
+      break;
+    }
+    if(!victim || slot->used < victim->used)
+    {
+      victim = slot;
+    }
+  }
+
+  if(!victim->key)
+  {
+    ++cache->count;
+  }
+  else if(victim->key != key)
+  {
+    ++cache->evictions;
+  }
+
+  victim->key = key;
+  victim->used = ++cache->clock;
+  memset(victim->device, 0x00, sizeof(victim->device));
+  strncpy(victim->device, device, sizeof(victim->device) - 1);
+  memcpy(victim->challenges, challenges, sizeof(victim->challenges));
+  memcpy(victim->responses, responses, sizeof(victim->responses));
+}
+
+/*
+ * A device leaves the event loop once it is done or failed,
+ * and the loop ends with the last one.
+ */
+static void device_finish(s_device* device, e_step step)
+{
+  device->step = step;
+  device->end = now_us();
+  if(!--pending)
+  {
+    done = 1;
+  }
+}
+
+static int pool_init()
+{
+  unsigned int i;
+  for(i=0; i<POOL_SIZE; ++i)
+  {
+    struct libusb_transfer* transfer = libusb_alloc_transfer(0);
+    if(!transfer)
+    {
+      fprintf(stderr, "libusb_alloc_transfer failed\n");
+      return -1;
+    }
+    transfer->buffer = pool_buffers[i];
+    pool.transfers[pool.free++] = transfer;
+  }
+  return 0;
+}
+
+/*
+ * Take a transfer from the pool, or allocate one that libusb frees after its callback.
+ */
+static struct libusb_transfer* pool_get()
+{
+  ++pool.taken;
+
+  if(pool.free)
+  {
+    return pool.transfers[--pool.free];
+  }
+
+  struct libusb_transfer* transfer = libusb_alloc_transfer(0);
+  unsigned char* buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + MAX_DATA_LENGTH);
+  if(!transfer || !buffer)
+  {
+    fprintf(stderr, "can't allocate a transfer\n");
+    libusb_free_transfer(transfer);
+    free(buffer);
+    return NULL;
+  }
+  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+  transfer->buffer = buffer;
+  ++pool.allocated;
+  return transfer;
+}
+
+static void pool_put(struct libusb_transfer* transfer)
+{
+  if(transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+  {
+    return;
+  }
+  pool.transfers[pool.free++] = transfer;
+}
+
+static void pool_free()
+{
+  while(pool.free)
+  {
+    libusb_free_transfer(pool.transfers[--pool.free]);
+  }
+}
+
+int send_next_transfer(s_device* device);
+
+/*
+ * Send the next poll after delay us, from the event loop.
+ */
+static void f2_schedule(s_device* device, unsigned long long delay)
+{
+  if(!delay)
+  {
+    send_next_transfer(device);
+    return;
+  }
+
+  if(eventloop_timer_start(device->f2.timer, delay) < 0)
+  {
+    device_finish(device, E_STEP_FAILED);
+  }
+}
+
+static int f2_expired(int fd, uint32_t events, void* user)
+{
+  send_next_transfer(user);
+  return 0;
+}
+
 void dump(unsigned char* buf, int len)
 {
   int i;
@@ -75,85 +669,157 @@ void dump(unsigned char* buf, int len)
   printf("\n");
 }
 
-void callback(struct libusb_transfer *transfer)
+static void process(struct libusb_transfer *transfer)
 {
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  printf("%ld.%06ld ", t.tv_sec, t.tv_usec);
+  s_device* device = transfer->user_data;
+  unsigned int latency = now_us() - device->submitted;
+  s_run* run = device->runs ? device->runs + device->run : NULL;
+
+  if(trace)
+  {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    printf("%ld.%06ld (%03u:%03u) ", t.tv_sec, t.tv_usec, device->bus, device->address);
+  }
 
   struct libusb_control_setup* setup = libusb_control_transfer_get_setup(transfer);
 
   if(transfer->status != LIBUSB_TRANSFER_COMPLETED)
   {
     fprintf(stderr, "libusb_transfer failed: bmRequestType=0x%02x, bRequest=0x%02x, wValue=0x%04x\n", setup->bmRequestType, setup->bRequest, setup->wValue);
-    done = 1;
+    device_finish(device, E_STEP_FAILED);
     return;
   }
 
-  printf("libusb_transfer: bmRequestType=0x%02x, bRequest=0x%02x, wValue=0x%04x\n", setup->bmRequestType, setup->bRequest, setup->wValue);
+  if(trace)
+  {
+    printf("libusb_transfer: bmRequestType=0x%02x, bRequest=0x%02x, wValue=0x%04x\n", setup->bmRequestType, setup->bRequest, setup->wValue);
+  }
 
-  if(step == E_STEP_F0)
+  if(device->step == E_STEP_F0)
   {
-    ++count;
-    if(count == CHALLENGES_NB)
+    if(run)
+    {
+      run->challenges[device->count] = latency;
+    }
+    ++device->count;
+    if(device->count == CHALLENGES_NB)
     {
-      step = E_STEP_F2;
+      device->step = E_STEP_F2;
+      device->f2.challenged = now_us();
+      device->f2.not_ready = 0;
+      device->f2.interval = f2_interval * 1000ULL;
+      device->f2.polls = 0;
+      f2_schedule(device, estimate.ready * F2_MARGIN / 100);
+    }
+    else
+    {
+      send_next_transfer(device);
     }
-    send_next_transfer(transfer->dev_handle);
   }
-  else if(step == E_STEP_F2)
+  else if(device->step == E_STEP_F2)
   {
     unsigned char *data = libusb_control_transfer_get_data(transfer);
-    dump(data, transfer->actual_length);
+    if(trace)
+    {
+      dump(data, transfer->actual_length);
+    }
     if(data[2] == 0x00)
     {
-      count = 0;
-      step = E_STEP_F1;
+      device->ready = now_us();
+      if(run)
+      {
+        run->polls = device->f2.polls;
+        run->ready = device->ready - device->f2.challenged;
+      }
+      estimate_update(device);
+      device->count = 0;
+      device->step = E_STEP_F1;
+      send_next_transfer(device);
     }
     else
     {
-      sleep(1);
+      s_f2* f2 = &device->f2;
+      f2->not_ready = f2->submitted;
+      f2_schedule(device, f2->interval);
+      /*
+       * Keep polling at the initial interval until the estimate is reached.
+       */
+      if(now_us() - f2->challenged >= estimate.ready)
+      {
+        f2->interval *= f2_backoff;
+        if(f2->interval > f2_max_interval * 1000ULL)
+        {
+          f2->interval = f2_max_interval * 1000ULL;
+        }
+      }
     }
-    send_next_transfer(transfer->dev_handle);
   }
-  else if(step == E_STEP_F1)
+  else if(device->step == E_STEP_F1)
   {
-    dump(libusb_control_transfer_get_data(transfer), transfer->actual_length);
-    ++count;
-    if(count == RESPONSE_NB)
+    unsigned char *data = libusb_control_transfer_get_data(transfer);
+    if(trace)
+    {
+      dump(data, transfer->actual_length);
+    }
+    memcpy(device->responses[device->count], data, transfer->actual_length);
+    if(run)
     {
-      step = E_STEP_DONE;
-      done = 1;
+      run->responses[device->count] = latency;
+    }
+    ++device->count;
+    if(device->count == RESPONSE_NB)
+    {
+      if(cache)
+      {
+        cache_store(device->id, challenges, device->responses);
+      }
+      if(run)
+      {
+        run->total = now_us() - device->start;
+        /*
+         * Start the next run right away.
+         */
+        if(++device->run < bench_runs)
+        {
+          device->step = E_STEP_F0;
+          device->count = 0;
+          device->start = now_us();
+          send_next_transfer(device);
+          return;
+        }
+      }
+      device_finish(device, E_STEP_DONE);
     }
     else
     {
-      send_next_transfer(transfer->dev_handle);
+      send_next_transfer(device);
     }
   }
 }
 
-int send_next_transfer(libusb_device_handle* devh)
+void callback(struct libusb_transfer *transfer)
 {
-  struct libusb_transfer* transfer = libusb_alloc_transfer(0);
-
-  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER ;
+  process(transfer);
 
-  unsigned char* buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE+MAX_DATA_LENGTH);
+  pool_put(transfer);
+}
 
+int send_next_transfer(s_device* device)
+{
   uint8_t bmRequestType;
   uint8_t bRequest;
   uint16_t wValue = 0x0300;
   uint16_t wIndex = 0x0000;
   uint16_t wLength;
 
-  switch(step)
+  switch(device->step)
   {
     case E_STEP_F0:
       bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
       bRequest = LIBUSB_REQUEST_SET_CONFIGURATION;
       wValue |= 0xf0;
       wLength = 0x0040;
-      memcpy(buffer+LIBUSB_CONTROL_SETUP_SIZE, challenges[count], MAX_DATA_LENGTH);
       break;
     case E_STEP_F2:
       bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
@@ -167,36 +833,248 @@ int send_next_transfer(libusb_device_handle* devh)
       wValue |= 0xf1;
       wLength = 0x0040;
       break;
+    default:
+      return -1;
+  }
+
+  struct libusb_transfer* transfer = pool_get();
+  if(!transfer)
+  {
+    device_finish(device, E_STEP_FAILED);
+    return -1;
+  }
+
+  unsigned char* buffer = transfer->buffer;
+
+  if(device->step == E_STEP_F0)
+  {
+    memcpy(buffer+LIBUSB_CONTROL_SETUP_SIZE, challenges[device->count], MAX_DATA_LENGTH);
   }
 
   libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex, wLength);
-  libusb_fill_control_transfer(transfer, devh, buffer, callback, (void*)42, 1000);
+  libusb_fill_control_transfer(transfer, device->devh, buffer, callback, device, 1000);
 
   int ret = libusb_submit_transfer(transfer);
   if(ret < 0)
   {
     fprintf(stderr, "libusb_submit_transfer: %s.\n", libusb_strerror(ret));
+    if(transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+    {
+      libusb_free_transfer(transfer);
+    }
+    else
+    {
+      pool_put(transfer);
+    }
+    device_finish(device, E_STEP_FAILED);
     return -1;
   }
 
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  printf("%ld.%06ld ", t.tv_sec, t.tv_usec);
+  device->submitted = now_us();
+
+  if(device->step == E_STEP_F2)
+  {
+    device->f2.submitted = device->submitted;
+    ++device->f2.polls;
+  }
 
-  printf("libusb_submit_transfer: bmRequestType=0x%02x, bRequest=0x%02x, wValue=0x%04x\n", bmRequestType, bRequest, wValue);
+  if(trace)
+  {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    printf("%ld.%06ld (%03u:%03u) ", t.tv_sec, t.tv_usec, device->bus, device->address);
+
+    printf("libusb_submit_transfer: bmRequestType=0x%02x, bRequest=0x%02x, wValue=0x%04x\n", bmRequestType, bRequest, wValue);
+  }
 
   return 0;
 }
 
-#define MAX_FD 64
+/*
+ * Per-device timings: challenge upload, wait for the response, response read, total.
+ */
+static void print_summary()
+{
+  unsigned int i;
+  unsigned int authenticated = 0;
+  unsigned long long first = 0, last = 0;
+
+  printf("device   challenges  wait            responses   total\n");
+
+  unsigned int cached = 0;
+
+  for(i=0; i<nb_devices; ++i)
+  {
+    s_device* device = devices + i;
+    if(device->cached)
+    {
+      printf("%03u:%03u  cached\n", device->bus, device->address);
+      ++cached;
+      continue;
+    }
+    if(device->step != E_STEP_DONE)
+    {
+      printf("%03u:%03u  failed\n", device->bus, device->address);
+      continue;
+    }
+    printf("%03u:%03u  %7.1f ms  %7.1f ms (%u)  %7.1f ms  %7.1f ms\n", device->bus, device->address,
+        (device->f2.challenged - device->start) / 1000.0, (device->ready - device->f2.challenged) / 1000.0,
+        device->f2.polls, (device->end - device->ready) / 1000.0, (device->end - device->start) / 1000.0);
+    if(!authenticated || device->start < first)
+    {
+      first = device->start;
+    }
+    if(device->end > last)
+    {
+      last = device->end;
+    }
+    ++authenticated;
+  }
+
+  if(authenticated)
+  {
+    printf("%u/%u device(s) authenticated in %.1f ms\n", authenticated, nb_devices, (last - first) / 1000.0);
+  }
+  if(cached)
+  {
+    printf("%u/%u device(s) answered from the cache\n", cached, nb_devices);
+  }
+}
+
+static void bench_write()
+{
+  FILE* file = stdout;
+  if(bench_file)
+  {
+    file = fopen(bench_file, "w");
+    if(!file)
+    {
+      fprintf(stderr, "can't open %s: %s\n", bench_file, strerror(errno));
+      return;
+    }
+  }
+
+  unsigned int i, j, k;
+
+  fprintf(file, "device,run");
+  for(k=0; k<CHALLENGES_NB; ++k)
+  {
+    fprintf(file, ",challenge_%u_us", k);
+  }
+  fprintf(file, ",polls,ready_us");
+  for(k=0; k<RESPONSE_NB; ++k)
+  {
+    fprintf(file, ",response_%u_us", k);
+  }
+  fprintf(file, ",total_us\n");
+
+  for(i=0; i<nb_devices; ++i)
+  {
+    s_device* device = devices + i;
+    for(j=0; j<device->run; ++j)
+    {
+      s_run* run = device->runs + j;
+      fprintf(file, "%03u:%03u,%u", device->bus, device->address, j);
+      for(k=0; k<CHALLENGES_NB; ++k)
+      {
+        fprintf(file, ",%u", run->challenges[k]);
+      }
+      fprintf(file, ",%u,%u", run->polls, run->ready);
+      for(k=0; k<RESPONSE_NB; ++k)
+      {
+        fprintf(file, ",%u", run->responses[k]);
+      }
+      fprintf(file, ",%u\n", run->total);
+    }
+  }
+
+  if(bench_file)
+  {
+    fclose(file);
+  }
+}
+
+static int compare(const void* a, const void* b)
+{
+  unsigned int va = *(const unsigned int*)a;
+  unsigned int vb = *(const unsigned int*)b;
+  return (va > vb) - (va < vb);
+}
+
+/*
+ * Print the distribution of a value: first is the offset of the value in s_run,
+ * and the values at first, first + 1, ... first + nb - 1 are pooled.
+ */
+static void bench_print(const char* name, size_t first, unsigned int nb, double unit, unsigned int* values)
+{
+  unsigned int count = 0;
+  unsigned long long sum = 0;
+  unsigned int i, j, k;
+
+  for(i=0; i<nb_devices; ++i)
+  {
+    for(j=0; j<devices[i].run; ++j)
+    {
+      unsigned int* run = (unsigned int*)((char*)(devices[i].runs + j) + first);
+      for(k=0; k<nb; ++k)
+      {
+        values[count++] = run[k];
+        sum += run[k];
+      }
+    }
+  }
+
+  if(!count)
+  {
+    return;
+  }
+
+  qsort(values, count, sizeof(*values), compare);
+
+  printf("%-12s %6u %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, count, values[0] / unit, (double)sum / count / unit,
+      values[count / 2] / unit, values[count * 90 / 100] / unit, values[count * 99 / 100] / unit, values[count - 1] / unit);
+}
+
+static void bench_summary()
+{
+  unsigned int runs = 0;
+  unsigned int i;
+  char name[16];
+
+  for(i=0; i<nb_devices; ++i)
+  {
+    runs += devices[i].run;
+  }
+
+  unsigned int* values = calloc(runs * RESPONSE_NB + 1, sizeof(*values));
+  if(!values)
+  {
+    fprintf(stderr, "can't allocate memory\n");
+    return;
+  }
+
+  printf("phase             n       min      mean       p50       p90       p99       max\n");
+  for(i=0; i<CHALLENGES_NB; ++i)
+  {
+    snprintf(name, sizeof(name), "challenge %u", i);
+    bench_print(name, offsetof(s_run, challenges[i]), 1, 1000, values);
+  }
+  bench_print("polls", offsetof(s_run, polls), 1, 1, values);
+  bench_print("ready", offsetof(s_run, ready), 1, 1000, values);
+  bench_print("response", offsetof(s_run, responses), RESPONSE_NB, 1000, values);
+  bench_print("total", offsetof(s_run, total), 1, 1000, values);
+  printf("(ms, except polls)\n");
+
+  free(values);
+}
 
 int main(int argc, char *argv[])
 {
   int ret;
 
   libusb_device** devs;
-  libusb_device_handle* devh = NULL;
   libusb_context* ctx = NULL;
+  int i, j;
 
   /*
    * Set highest priority & scheduler policy.
@@ -210,6 +1088,29 @@ int main(int argc, char *argv[])
 
   (void) signal(SIGINT, terminate);
 
+  read_args(argc, argv);
+
+  static char home_estimate[PATH_MAX];
+  if(!estimate_file)
+  {
+    char* home = getenv("HOME");
+    snprintf(home_estimate, sizeof(home_estimate), "%s/.ds4auth", home ? home : ".");
+    estimate_file = home_estimate;
+  }
+
+  estimate_load();
+
+  /*
+   * The cache is not used in benchmark mode, so that the controllers are measured.
+   */
+  if(cache_file && !bench_runs)
+  {
+    if(cache_open() < 0)
+    {
+      exit(-1);
+    }
+  }
+
   ret = libusb_init(&ctx);
   if(ret < 0)
   {
@@ -217,82 +1118,172 @@ int main(int argc, char *argv[])
     return -1;
   }
 
+  if(eventloop_init() < 0)
+  {
+    exit(-1);
+  }
+
   ssize_t cnt = libusb_get_device_list(ctx, &devs);
 
-  int i;
-  for(i=0; i<cnt; ++i)
+  for(i=0; i<cnt && nb_devices < MAX_DEVICES; ++i)
   {
     struct libusb_device_descriptor desc;
     ret = libusb_get_device_descriptor(devs[i], &desc);
-    if(!ret)
+    if(ret || desc.idVendor != VENDOR || desc.idProduct != PRODUCT)
+    {
+      continue;
+    }
+
+    s_device* device = devices + nb_devices;
+
+    ret = libusb_open(devs[i], &device->devh);
+    if(ret < 0)
+    {
+      fprintf(stderr, "Can't open device: %s.\n", libusb_strerror(ret));
+      continue;
+    }
+
+    libusb_set_auto_detach_kernel_driver(device->devh, 1);
+
+    ret = libusb_claim_interface(device->devh, 0);
+    if(ret < 0)
+    {
+      fprintf(stderr, "Can't claim interface: %s.\n", libusb_strerror(ret));
+      libusb_close(device->devh);
+      continue;
+    }
+
+    device->bus = libusb_get_bus_number(devs[i]);
+    device->address = libusb_get_device_address(devs[i]);
+
+    printf("device found: %03u:%03u\n", device->bus, device->address);
+
+    if(!desc.iSerialNumber
+        || libusb_get_string_descriptor_ascii(device->devh, desc.iSerialNumber, (unsigned char*)device->id, sizeof(device->id)) <= 0)
     {
-      if(desc.idVendor == VENDOR && desc.idProduct == PRODUCT)
+      snprintf(device->id, sizeof(device->id), "%03u:%03u", device->bus, device->address);
+    }
+
+    if(cache)
+    {
+      unsigned long long start = now_us();
+      s_cache_slot* slot = cache_lookup(device->id, challenges);
+      unsigned long long end = now_us();
+
+      if(slot)
       {
-        ret = libusb_open(devs[i], &devh);
-        if(!ret)
+        printf("%03u:%03u responses found in the cache in %llu us\n", device->bus, device->address, end - start);
+        for(j=0; j<RESPONSE_NB; ++j)
         {
-          libusb_set_auto_detach_kernel_driver(devh, 1);
-
-          ret = libusb_claim_interface(devh, 0);
-          if(ret < 0)
-          {
-            fprintf(stderr, "Can't claim interface: %s.\n", libusb_strerror(ret));
-            ret = -1;
-          }
-          else
-          {
-            break;
-          }
+          dump(slot->responses[j], MAX_DATA_LENGTH);
         }
+        memcpy(device->responses, slot->responses, sizeof(device->responses));
+        device->cached = 1;
+        device->step = E_STEP_DONE;
+        device->f2.timer = -1;
+        ++nb_devices;
+        continue;
+      }
+    }
+
+    device->f2.timer = eventloop_timer_create(f2_expired, device);
+    if(device->f2.timer < 0)
+    {
+      exit(-1);
+    }
+
+    if(bench_runs)
+    {
+      device->runs = calloc(bench_runs, sizeof(*device->runs));
+      if(!device->runs)
+      {
+        fprintf(stderr, "can't allocate memory\n");
+        exit(-1);
       }
     }
+
+    ++nb_devices;
+    ++pending;
   }
 
   libusb_free_device_list(devs, 1);
 
-  if(i == cnt)
+  if(!nb_devices)
   {
     fprintf(stderr, "no device found\n");
     exit(-1);
   }
 
-  printf("device found\n");
+  if(eventloop_add_libusb(ctx) < 0)
+  {
+    exit(-1);
+  }
+
+  if(pool_init() < 0)
+  {
+    exit(-1);
+  }
 
-  const struct libusb_pollfd** pfd_usb = libusb_get_pollfds(ctx);
+#ifdef DS4AUTH_HEAP_COUNT
+  heap_counting = 1;
+#endif
 
-  struct pollfd pfd[MAX_FD] = {};
+  for(i=0; i<nb_devices; ++i)
+  {
+    if(!devices[i].cached)
+    {
+      devices[i].start = now_us();
+      send_next_transfer(devices + i);
+    }
+  }
 
-  for (i=0; pfd_usb[i] != NULL; i++)
+  if(pending)
   {
-    pfd[i].fd = pfd_usb[i]->fd;
-    pfd[i].events = pfd_usb[i]->events;
+    eventloop_run(&done);
   }
 
-  int nbfd = i;
+#ifdef DS4AUTH_HEAP_COUNT
+  heap_counting = 0;
+#endif
+
+  print_summary();
+
+  if(bench_runs)
+  {
+    bench_write();
+    bench_summary();
+  }
 
-  send_next_transfer(devh);
+  printf("transfers: %llu taken from the pool, %llu allocated\n", pool.taken, pool.allocated);
+#ifdef DS4AUTH_HEAP_COUNT
+  printf("heap: %llu allocation(s) during the authentication\n", heap_allocs);
+#endif
 
-  while(!done)
+  for(i=0; i<nb_devices; ++i)
   {
-    if(poll(pfd, nbfd, -1))
+    if(devices[i].step == E_STEP_DONE && !devices[i].cached)
     {
-      for(i=0; i<nbfd; ++i)
-      {
-        if (pfd[i].revents & (POLLERR | POLLHUP))
-        {
-          done = 1;
-        }
-        if(pfd[i].revents & (POLLOUT | POLLIN))
-        {
-          libusb_handle_events(ctx);
-        }
-      }
+      estimate_save();
+      break;
     }
   }
 
-  libusb_release_interface(devh, 0);
+  for(i=0; i<nb_devices; ++i)
+  {
+    eventloop_timer_close(devices[i].f2.timer);
+
+    libusb_release_interface(devices[i].devh, 0);
+
+    libusb_close(devices[i].devh);
+
+    free(devices[i].runs);
+  }
+
+  pool_free();
+
+  cache_close();
 
-  libusb_close(devh);
+  eventloop_close();
 
   libusb_exit(ctx);
 
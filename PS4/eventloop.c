@@ -0,0 +1,305 @@
+/*
+ License: GPLv3
+
+ See eventloop.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "eventloop.h"
+
+#define EVENTLOOP_MAX_FDS 1024
+#define EVENTLOOP_MAX_EVENTS 64
+
+/*
+ * Handlers are indexed by file descriptor, so that an event that is still pending
+ * for a descriptor removed by a previous callback of the same wakeup is ignored.
+ */
+typedef struct
+{
+  EVENTLOOP_CALLBACK callback;
+  void* user;
+  int usb;
+} s_handler;
+
+static s_handler handlers[EVENTLOOP_MAX_FDS];
+
+static int epfd = -1;
+static libusb_context* usb_ctx = NULL;
+
+int eventloop_init()
+{
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(epfd < 0)
+  {
+    fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int add(int fd, uint32_t events, EVENTLOOP_CALLBACK callback, void* user, int usb)
+{
+  if(fd < 0 || fd >= EVENTLOOP_MAX_FDS)
+  {
+    fprintf(stderr, "%s: bad file descriptor %d\n", __func__, fd);
+    return -1;
+  }
+
+  struct epoll_event event = { .events = events, .data.fd = fd };
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+  {
+    fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+    return -1;
+  }
+
+  handlers[fd].callback = callback;
+  handlers[fd].user = user;
+  handlers[fd].usb = usb;
+
+  return 0;
+}
+
+int eventloop_add(int fd, uint32_t events, EVENTLOOP_CALLBACK callback, void* user)
+{
+  return add(fd, events, callback, user, 0);
+}
+
+int eventloop_remove(int fd)
+{
+  if(fd < 0 || fd >= EVENTLOOP_MAX_FDS)
+  {
+    return -1;
+  }
+
+  memset(handlers + fd, 0x00, sizeof(*handlers));
+
+  if(epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+  {
+    fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static uint32_t usb_events(short events)
+{
+  return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+static void usb_added(int fd, short events, void* user)
+{
+  add(fd, usb_events(events), NULL, NULL, 1);
+}
+
+static void usb_removed(int fd, void* user)
+{
+  eventloop_remove(fd);
+}
+
+int eventloop_add_libusb(libusb_context* ctx)
+{
+  const struct libusb_pollfd** pollfds = libusb_get_pollfds(ctx);
+  if(!pollfds)
+  {
+    fprintf(stderr, "libusb_get_pollfds failed\n");
+    return -1;
+  }
+
+  int ret = 0;
+  int i;
+  for(i=0; pollfds[i] && ret >= 0; ++i)
+  {
+    ret = add(pollfds[i]->fd, usb_events(pollfds[i]->events), NULL, NULL, 1);
+  }
+
+  libusb_free_pollfds(pollfds);
+
+  if(ret >= 0)
+  {
+    usb_ctx = ctx;
+    libusb_set_pollfd_notifiers(ctx, usb_added, usb_removed, NULL);
+  }
+
+  return ret;
+}
+
+static int timer_read(int fd, uint32_t events, void* user)
+{
+  s_handler* handler = user;
+  uint64_t expirations;
+
+  if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+  {
+    return 0;
+  }
+
+  return handler->callback(fd, events, handler->user);
+}
+
+/*
+ * The timer handler keeps the user callback, and the epoll handler calls timer_read with it.
+ */
+static s_handler timers[EVENTLOOP_MAX_FDS];
+
+int eventloop_timer_create(EVENTLOOP_CALLBACK callback, void* user)
+{
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(timer < 0)
+  {
+    fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if(timer >= EVENTLOOP_MAX_FDS)
+  {
+    fprintf(stderr, "%s: bad file descriptor %d\n", __func__, timer);
+    close(timer);
+    return -1;
+  }
+
+  timers[timer].callback = callback;
+  timers[timer].user = user;
+
+  if(add(timer, EPOLLIN, timer_read, timers + timer, 0) < 0)
+  {
+    close(timer);
+    return -1;
+  }
+
+  return timer;
+}
+
+int eventloop_timer_start(int timer, unsigned long long delay)
+{
+  if(!delay)
+  {
+    // a zero value disarms the timer
+    delay = 1;
+  }
+
+  struct itimerspec its =
+  {
+    .it_value = { .tv_sec = delay / 1000000, .tv_nsec = (delay % 1000000) * 1000 },
+  };
+  if(timerfd_settime(timer, 0, &its, NULL) < 0)
+  {
+    fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void eventloop_timer_close(int timer)
+{
+  if(timer < 0)
+  {
+    return;
+  }
+  eventloop_remove(timer);
+  close(timer);
+}
+
+/*
+ * The epoll timeout is the next libusb timeout, if any.
+ */
+static int usb_timeout(int* expired)
+{
+  struct timeval tv;
+
+  *expired = 0;
+
+  if(!usb_ctx || libusb_get_next_timeout(usb_ctx, &tv) != 1)
+  {
+    return -1;
+  }
+
+  if(!tv.tv_sec && !tv.tv_usec)
+  {
+    *expired = 1;
+    return 0;
+  }
+
+  // round up, so that the timeout has expired when epoll_wait returns
+  return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+int eventloop_run(volatile int* done)
+{
+  struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+  struct timeval zero = { 0, 0 };
+  int i;
+
+  while(!*done)
+  {
+    int expired;
+    int timeout = usb_timeout(&expired);
+
+    int nfds = epoll_wait(epfd, events, EVENTLOOP_MAX_EVENTS, timeout);
+    if(nfds < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+      return -1;
+    }
+
+    int usb_ready = expired || (!nfds && timeout >= 0);
+
+    for(i=0; i<nfds; ++i)
+    {
+      s_handler* handler = handlers + events[i].data.fd;
+      if(handler->usb)
+      {
+        usb_ready = 1;
+      }
+      else if(handler->callback)
+      {
+        if(handler->callback(events[i].data.fd, events[i].events, handler->user) < 0)
+        {
+          return -1;
+        }
+      }
+    }
+
+    /*
+     * Handle all libusb events and timeouts at once, without blocking.
+     */
+    if(usb_ready)
+    {
+      int ret = libusb_handle_events_timeout(usb_ctx, &zero);
+      if(ret < 0)
+      {
+        fprintf(stderr, "libusb_handle_events_timeout: %s.\n", libusb_strerror(ret));
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+void eventloop_close()
+{
+  if(usb_ctx)
+  {
+    libusb_set_pollfd_notifiers(usb_ctx, NULL, NULL, NULL);
+    usb_ctx = NULL;
+  }
+  if(epfd >= 0)
+  {
+    close(epfd);
+    epfd = -1;
+  }
+}
@@ -0,0 +1,44 @@
+/*
+ License: GPLv3
+
+ An epoll based event loop for the tools that use asynchronous libusb transfers:
+ libusb file descriptors, timers and any other descriptors are waited for in a single epoll set,
+ and libusb events and timeouts are handled once per wakeup.
+ */
+
+#ifndef EVENTLOOP_H_
+#define EVENTLOOP_H_
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+/*
+ * Called when fd is ready, with the epoll events.
+ * Returning a negative value stops the event loop.
+ */
+typedef int (*EVENTLOOP_CALLBACK)(int fd, uint32_t events, void* user);
+
+int eventloop_init();
+void eventloop_close();
+
+int eventloop_add(int fd, uint32_t events, EVENTLOOP_CALLBACK callback, void* user);
+int eventloop_remove(int fd);
+
+/*
+ * Follows the file descriptors libusb adds and removes, and honours the timeouts it reports.
+ */
+int eventloop_add_libusb(libusb_context* ctx);
+
+/*
+ * One-shot timers: the callback is called once the timer expires.
+ */
+int eventloop_timer_create(EVENTLOOP_CALLBACK callback, void* user);
+int eventloop_timer_start(int timer, unsigned long long delay); // us
+void eventloop_timer_close(int timer);
+
+/*
+ * Waits for events until *done is set or a callback returns a negative value.
+ */
+int eventloop_run(volatile int* done);
+
+#endif /* EVENTLOOP_H_ */
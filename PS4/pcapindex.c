@@ -0,0 +1,612 @@
+/*
+ License: GPLv3
+
+ Builds a sidecar index for big sniffer captures, and uses it to extract
+ a time window, a packet type or a connection handle without scanning the whole file.
+
+ The index lists blocks of consecutive records that share a time bucket,
+ with their file offset, the packet types they contain, and a mask of their ACL/SCO handles.
+ It is built in parallel: each thread indexes a range of the mmap'd capture,
+ after finding the first record boundary in it.
+
+ Compile: gcc -O2 -o pcapindex pcapindex.c -lpthread
+ Run:
+ $ ./pcapindex -i capture.pcap
+ $ ./pcapindex -q capture.pcap -s 3600 -e 3610 -w window.pcap
+ $ ./pcapindex -q capture.pcap -H 0x0040 -t acl | wireshark -k -i -
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#define HCI_COMMAND_PKT         0x01
+#define HCI_ACLDATA_PKT         0x02
+#define HCI_SCODATA_PKT         0x03
+#define HCI_EVENT_PKT           0x04
+#define HCI_VENDOR_PKT          0xff
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_HEADER_SIZE 24
+#define RECORD_HEADER_SIZE 16
+#define H4_HEADER_SIZE 4
+
+#define INDEX_MAGIC 0x58444950 // "PIDX"
+#define INDEX_VERSION 1
+
+/*
+ * Number of consecutive records that have to look valid to find a record boundary.
+ */
+#define SYNC_DEPTH 8
+
+#define MAX_THREADS 64
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t bucket_usec;
+  uint32_t t0_sec;
+  uint32_t t0_usec;
+  uint32_t blocks_nb;
+  uint64_t capture_size;
+} s_index_header;
+
+typedef struct
+{
+  uint32_t bucket; /* time bucket, relative to t0 */
+  uint32_t records;
+  uint64_t offset;
+  uint64_t length;
+  uint32_t types; /* bit 0-3: H4 types 1-4, bit 4: vendor */
+  uint32_t reserved;
+  uint64_t handles; /* bit (handle % 64) */
+} s_index_block;
+
+typedef struct
+{
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} s_record_header;
+
+static const unsigned char* capture = NULL;
+static size_t capture_size = 0;
+static uint32_t snaplen = 0;
+static uint32_t t0_sec = 0;
+static uint32_t t0_usec = 0;
+static uint32_t bucket_usec = 1000000;
+
+static char* index_mode = NULL;
+static char* query_mode = NULL;
+static char* output = NULL;
+static int threads_nb = 0;
+static double start = -1;
+static double end = -1;
+static int handle = -1;
+static int type = -1;
+
+static void usage()
+{
+  fprintf(stderr, "Usage: pcapindex -i capture [-b ms] [-j threads]\n");
+  fprintf(stderr, "       pcapindex -q capture [-s seconds] [-e seconds] [-t type] [-H handle] [-w output]\n");
+  fprintf(stderr, "  -i: build capture.pidx\n");
+  fprintf(stderr, "  -b: time bucket (default: 1000ms)\n");
+  fprintf(stderr, "  -j: number of threads (default: number of cores)\n");
+  fprintf(stderr, "  -q: extract packets using capture.pidx\n");
+  fprintf(stderr, "  -s, -e: time window, in seconds since the first packet\n");
+  fprintf(stderr, "  -t: cmd|acl|sco|evt|vendor|<n>\n");
+  fprintf(stderr, "  -H: ACL or SCO connection handle\n");
+  fprintf(stderr, "  -w: output file (default: stdout)\n");
+  exit(EXIT_FAILURE);
+}
+
+static int parse_type(const char* value)
+{
+  static const struct
+  {
+    const char* name;
+    unsigned char type;
+  } types[] =
+  {
+    { "cmd",    HCI_COMMAND_PKT },
+    { "acl",    HCI_ACLDATA_PKT },
+    { "sco",    HCI_SCODATA_PKT },
+    { "evt",    HCI_EVENT_PKT },
+    { "vendor", HCI_VENDOR_PKT },
+  };
+  unsigned int i;
+  for(i=0; i<sizeof(types)/sizeof(*types); ++i)
+  {
+    if(!strcmp(value, types[i].name))
+    {
+      return types[i].type;
+    }
+  }
+  char* end;
+  long type = strtol(value, &end, 0);
+  if(*value && !*end && type >= 0 && type <= 0xff)
+  {
+    return type;
+  }
+  return -1;
+}
+
+/*
+ * Reads command-line arguments.
+ */
+static void read_args(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, ":i:b:j:q:s:e:t:H:w:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'i':
+        index_mode = optarg;
+        break;
+      case 'b':
+        bucket_usec = strtoul(optarg, NULL, 10) * 1000;
+        break;
+      case 'j':
+        threads_nb = strtol(optarg, NULL, 10);
+        break;
+      case 'q':
+        query_mode = optarg;
+        break;
+      case 's':
+        start = strtod(optarg, NULL);
+        break;
+      case 'e':
+        end = strtod(optarg, NULL);
+        break;
+      case 't':
+        type = parse_type(optarg);
+        if(type < 0)
+        {
+          usage();
+        }
+        break;
+      case 'H':
+        handle = strtol(optarg, NULL, 0) & 0x0fff;
+        break;
+      case 'w':
+        output = optarg;
+        break;
+      default: /* '?' */
+        usage();
+        break;
+    }
+  }
+
+  if(!index_mode == !query_mode || !bucket_usec)
+  {
+    usage();
+  }
+
+  if(threads_nb <= 0)
+  {
+    threads_nb = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if(threads_nb > MAX_THREADS)
+  {
+    threads_nb = MAX_THREADS;
+  }
+}
+
+static void* map_file(const char* name, size_t* size)
+{
+  int fd = open(name, O_RDONLY);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || !st.st_size)
+  {
+    fprintf(stderr, "can't use %s\n", name);
+    close(fd);
+    return NULL;
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    fprintf(stderr, "can't map %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  *size = st.st_size;
+  return data;
+}
+
+static int capture_open(const char* name)
+{
+  capture = map_file(name, &capture_size);
+  if(!capture)
+  {
+    return -1;
+  }
+  if(capture_size < PCAP_HEADER_SIZE || *(uint32_t*)capture != PCAP_MAGIC)
+  {
+    fprintf(stderr, "%s is not a native-endian pcap file\n", name);
+    return -1;
+  }
+  snaplen = *(uint32_t*)(capture + 16);
+  if(capture_size >= PCAP_HEADER_SIZE + RECORD_HEADER_SIZE)
+  {
+    const s_record_header* header = (const s_record_header*)(capture + PCAP_HEADER_SIZE);
+    t0_sec = header->ts_sec;
+    t0_usec = header->ts_usec;
+  }
+  return 0;
+}
+
+/*
+ * Returns the length of a plausible record at offset, 0 otherwise.
+ */
+static size_t record_length(size_t offset)
+{
+  if(offset + RECORD_HEADER_SIZE > capture_size)
+  {
+    return 0;
+  }
+  s_record_header header;
+  memcpy(&header, capture + offset, sizeof(header));
+  if(header.incl_len < H4_HEADER_SIZE + 1 || header.incl_len > header.orig_len || header.incl_len > snaplen
+      || header.ts_usec >= 1000000 || (int64_t)header.ts_sec - t0_sec < -86400 || (int64_t)header.ts_sec - t0_sec > 10 * 365 * 86400LL
+      || offset + RECORD_HEADER_SIZE + header.incl_len > capture_size)
+  {
+    return 0;
+  }
+  return RECORD_HEADER_SIZE + header.incl_len;
+}
+
+/*
+ * Tells if a record starts at offset, followed by SYNC_DEPTH-1 others or by the end of the file.
+ */
+static int record_boundary(size_t offset)
+{
+  int i;
+  for(i=0; i<SYNC_DEPTH && offset < capture_size; ++i)
+  {
+    size_t length = record_length(offset);
+    if(!length)
+    {
+      return 0;
+    }
+    offset += length;
+  }
+  return 1;
+}
+
+typedef struct
+{
+  size_t begin; /* first record found in the range */
+  size_t limit; /* records starting before it belong to the range */
+  size_t stop; /* end of the last record */
+  s_index_block* blocks;
+  unsigned int blocks_nb;
+  unsigned int blocks_size;
+  int error;
+} s_range;
+
+static s_index_block* range_new_block(s_range* range)
+{
+  if(range->blocks_nb == range->blocks_size)
+  {
+    range->blocks_size = range->blocks_size ? range->blocks_size * 2 : 1024;
+    range->blocks = realloc(range->blocks, range->blocks_size * sizeof(*range->blocks));
+    if(!range->blocks)
+    {
+      fprintf(stderr, "can't allocate index blocks\n");
+      exit(-1);
+    }
+  }
+  s_index_block* block = range->blocks + range->blocks_nb++;
+  memset(block, 0x00, sizeof(*block));
+  return block;
+}
+
+static uint32_t record_bucket(const s_record_header* header)
+{
+  long long usec = ((int64_t)header->ts_sec - t0_sec) * 1000000 + (long long)header->ts_usec - t0_usec;
+  return usec > 0 ? usec / bucket_usec : 0;
+}
+
+static void range_index(s_range* range)
+{
+  size_t offset = range->begin;
+  s_index_block* block = NULL;
+
+  range->blocks_nb = 0;
+
+  while(offset < range->limit && offset < capture_size)
+  {
+    size_t length = record_length(offset);
+    if(!length)
+    {
+      fprintf(stderr, "bad record at offset %zu\n", offset);
+      range->error = 1;
+      break;
+    }
+
+    const s_record_header* header = (const s_record_header*)(capture + offset);
+    const unsigned char* packet = capture + offset + RECORD_HEADER_SIZE + H4_HEADER_SIZE;
+    uint32_t bucket = record_bucket(header);
+
+    if(!block || block->bucket != bucket)
+    {
+      block = range_new_block(range);
+      block->bucket = bucket;
+      block->offset = offset;
+    }
+
+    ++block->records;
+    block->length += length;
+    block->types |= 1 << (packet[0] == HCI_VENDOR_PKT ? 4 : (packet[0] - 1) & 0x1f);
+    if((packet[0] == HCI_ACLDATA_PKT || packet[0] == HCI_SCODATA_PKT) && header->incl_len >= H4_HEADER_SIZE + 3)
+    {
+      block->handles |= 1ULL << ((packet[1] | (packet[2] & 0x0f) << 8) % 64);
+    }
+
+    offset += length;
+  }
+
+  range->stop = offset;
+}
+
+static void* index_thread(void* arg)
+{
+  s_range* range = arg;
+
+  // find the first record boundary in the range
+  while(range->begin < range->limit && !record_boundary(range->begin))
+  {
+    ++range->begin;
+  }
+
+  range_index(range);
+
+  return NULL;
+}
+
+static int build_index(const char* name)
+{
+  struct timespec t1, t2;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if(capture_open(name) < 0)
+  {
+    return -1;
+  }
+
+  s_range ranges[MAX_THREADS] = {};
+  pthread_t threads[MAX_THREADS];
+  size_t range_size = (capture_size - PCAP_HEADER_SIZE) / threads_nb + 1;
+  int i;
+
+  for(i=0; i<threads_nb; ++i)
+  {
+    ranges[i].begin = PCAP_HEADER_SIZE + i * range_size;
+    ranges[i].limit = ranges[i].begin + range_size;
+  }
+
+  for(i=0; i<threads_nb; ++i)
+  {
+    if(pthread_create(threads + i, NULL, index_thread, ranges + i))
+    {
+      fprintf(stderr, "can't create thread\n");
+      return -1;
+    }
+  }
+
+  for(i=0; i<threads_nb; ++i)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  /*
+   * Each range has to start where the previous one stopped.
+   * If a thread picked a wrong boundary, index its range again from the right one.
+   */
+  for(i=1; i<threads_nb; ++i)
+  {
+    if(ranges[i].begin != ranges[i-1].stop)
+    {
+      ranges[i].begin = ranges[i-1].stop;
+      ranges[i].error = 0;
+      range_index(ranges + i);
+    }
+  }
+
+  s_index_header header =
+  {
+    .magic = INDEX_MAGIC,
+    .version = INDEX_VERSION,
+    .bucket_usec = bucket_usec,
+    .t0_sec = t0_sec,
+    .t0_usec = t0_usec,
+    .capture_size = capture_size,
+  };
+
+  for(i=0; i<threads_nb; ++i)
+  {
+    if(ranges[i].error)
+    {
+      return -1;
+    }
+    header.blocks_nb += ranges[i].blocks_nb;
+  }
+
+  char index_name[strlen(name) + sizeof(".pidx")];
+  sprintf(index_name, "%s.pidx", name);
+
+  FILE* file = fopen(index_name, "w");
+  if(!file)
+  {
+    fprintf(stderr, "can't open %s\n", index_name);
+    return -1;
+  }
+
+  fwrite(&header, 1, sizeof(header), file);
+  for(i=0; i<threads_nb; ++i)
+  {
+    fwrite(ranges[i].blocks, sizeof(*ranges[i].blocks), ranges[i].blocks_nb, file);
+    free(ranges[i].blocks);
+  }
+  fclose(file);
+
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  fprintf(stderr, "%s: %u block(s), %zu bytes indexed in %.3fs with %d thread(s)\n", index_name, header.blocks_nb,
+      capture_size, (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9, threads_nb);
+
+  return 0;
+}
+
+static int record_match(size_t offset, size_t length)
+{
+  const s_record_header* header = (const s_record_header*)(capture + offset);
+  const unsigned char* packet = capture + offset + RECORD_HEADER_SIZE + H4_HEADER_SIZE;
+  double time = (double)((int64_t)header->ts_sec - t0_sec) + ((double)header->ts_usec - t0_usec) / 1e6;
+
+  if((start >= 0 && time < start) || (end >= 0 && time > end))
+  {
+    return 0;
+  }
+  if(type >= 0 && packet[0] != type)
+  {
+    return 0;
+  }
+  if(handle >= 0)
+  {
+    if((packet[0] != HCI_ACLDATA_PKT && packet[0] != HCI_SCODATA_PKT) || length < RECORD_HEADER_SIZE + H4_HEADER_SIZE + 3
+        || (packet[1] | (packet[2] & 0x0f) << 8) != handle)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int query_index(const char* name)
+{
+  struct timespec t1, t2;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if(capture_open(name) < 0)
+  {
+    return -1;
+  }
+
+  char index_name[strlen(name) + sizeof(".pidx")];
+  sprintf(index_name, "%s.pidx", name);
+
+  size_t index_size;
+  const s_index_header* header = map_file(index_name, &index_size);
+  if(!header)
+  {
+    return -1;
+  }
+
+  if(index_size < sizeof(*header) || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION
+      || index_size != sizeof(*header) + header->blocks_nb * sizeof(s_index_block))
+  {
+    fprintf(stderr, "bad index %s\n", index_name);
+    return -1;
+  }
+
+  if(header->capture_size != capture_size)
+  {
+    fprintf(stderr, "%s does not match %s, build it again\n", index_name, name);
+    return -1;
+  }
+
+  bucket_usec = header->bucket_usec;
+  t0_sec = header->t0_sec;
+  t0_usec = header->t0_usec;
+
+  FILE* file = stdout;
+  if(output)
+  {
+    file = fopen(output, "w");
+    if(!file)
+    {
+      fprintf(stderr, "can't open %s\n", output);
+      return -1;
+    }
+  }
+
+  fwrite(capture, 1, PCAP_HEADER_SIZE, file);
+
+  const s_index_block* blocks = (const s_index_block*)(header + 1);
+  uint32_t first = start >= 0 ? start * 1e6 / bucket_usec : 0;
+  uint32_t last = end >= 0 ? end * 1e6 / bucket_usec : UINT32_MAX;
+  uint32_t types = type >= 0 ? 1 << (type == HCI_VENDOR_PKT ? 4 : (type - 1) & 0x1f) : UINT32_MAX;
+  uint64_t handles = handle >= 0 ? 1ULL << (handle % 64) : 0;
+  unsigned long long scanned = 0;
+  unsigned long long extracted = 0;
+  unsigned int i;
+
+  for(i=0; i<header->blocks_nb; ++i)
+  {
+    const s_index_block* block = blocks + i;
+    if(block->bucket < first || block->bucket > last || !(block->types & types) || (handles && !(block->handles & handles)))
+    {
+      continue;
+    }
+    size_t offset = block->offset;
+    size_t stop = block->offset + block->length;
+    while(offset < stop)
+    {
+      size_t length = RECORD_HEADER_SIZE + ((const s_record_header*)(capture + offset))->incl_len;
+      ++scanned;
+      if(record_match(offset, length))
+      {
+        fwrite(capture + offset, 1, length, file);
+        ++extracted;
+      }
+      offset += length;
+    }
+  }
+
+  if(output)
+  {
+    fclose(file);
+  }
+  else
+  {
+    fflush(file);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  fprintf(stderr, "%llu packet(s) extracted, %llu scanned in %.3fs\n", extracted, scanned,
+      (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  read_args(argc, argv);
+
+  if(index_mode)
+  {
+    return build_index(index_mode) < 0 ? -1 : 0;
+  }
+
+  return query_index(query_mode) < 0 ? -1 : 0;
+}
@@ -0,0 +1,923 @@
+/*
+ License: GPLv3
+
+ Replays raw UART byte streams into the sniffer through pseudo-terminals,
+ then checks the resulting capture against the packets of the streams.
+
+ Compile: gcc -o sniffer-replay sniffer-replay.c
+ Run:
+ $ ./sniffer-replay -g 100000
+ $ ./sniffer-replay -r 3000000 line0.raw line1.raw
+ $ ./sniffer-replay -r 1000000 -m -g 100000
+ $ ./sniffer-replay -g 10000 -- -f type=acl
+ $ ./sniffer-replay -g 100000 -p -- -U
+ $ ./sniffer-replay -V -g 100000
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+
+#define RX_LINES 2
+
+#define HCI_COMMAND_PKT         0x01
+#define HCI_ACLDATA_PKT         0x02
+#define HCI_SCODATA_PKT         0x03
+#define HCI_EVENT_PKT           0x04
+#define HCI_VENDOR_PKT          0xff
+
+/*
+ * Bytes written to the pseudo-terminal at once, similar to a full-speed USB packet.
+ */
+#define WRITE_CHUNK 64
+
+/*
+ * Look-ahead used to match captured packets with the expected ones.
+ */
+#define MATCH_WINDOW 32
+
+typedef struct
+{
+  unsigned char* data;
+  unsigned int length;
+  unsigned long long written; /* us, when its last byte was written, 0 if it was not */
+} s_packet;
+
+typedef struct
+{
+  unsigned char* data;
+  unsigned int size;
+  unsigned int length;
+  s_packet* packets;
+  unsigned int packets_nb;
+} s_stream;
+
+static s_stream streams[RX_LINES] = {};
+
+static char* sniffer = "./sniffer";
+static unsigned int rate = 3000000; // bps
+static unsigned int generate = 0;
+static char* save = NULL;
+static int sweep = 0;
+static int pipe_mode = 0;
+static char* output = "/tmp/sniffer-replay.pcap";
+static int vhci = 0;
+static char** extra_args = NULL;
+static int extra_args_nb = 0;
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sniffer-replay [-s sniffer] [-r rate] [-m] [-w capture] [-p] [-V] (-g packets [-o prefix] | line0.raw line1.raw) [-- sniffer args]\n");
+  fprintf(stderr, "  -s: sniffer binary (default: ./sniffer)\n");
+  fprintf(stderr, "  -r: replay rate in bps, 10 bits per byte (default: 3000000)\n");
+  fprintf(stderr, "  -m: double the rate until packets get lost, and report the max sustainable rate\n");
+  fprintf(stderr, "  -w: capture file (default: /tmp/sniffer-replay.pcap)\n");
+  fprintf(stderr, "  -p: get the capture from the sniffer stdout instead of using -w\n");
+  fprintf(stderr, "  -g: generate streams with the given number of packets\n");
+  fprintf(stderr, "  -o: save the generated streams to prefix0.raw and prefix1.raw\n");
+  fprintf(stderr, "  -V: inject the controller packets of line 1 into a hci_vhci virtual controller,\n");
+  fprintf(stderr, "      and capture them with sniffer -M (needs the hci_vhci module and root)\n");
+  exit(EXIT_FAILURE);
+}
+
+static void stream_append(s_stream* stream, const unsigned char* data, unsigned int length)
+{
+  if(stream->length + length > stream->size)
+  {
+    stream->size = (stream->length + length) * 2;
+    stream->data = realloc(stream->data, stream->size);
+    if(!stream->data)
+    {
+      fprintf(stderr, "can't allocate stream\n");
+      exit(-1);
+    }
+  }
+  memcpy(stream->data + stream->length, data, length);
+  stream->length += length;
+}
+
+static int stream_load(s_stream* stream, const char* name)
+{
+  FILE* file = fopen(name, "r");
+  if(!file)
+  {
+    fprintf(stderr, "can't open %s\n", name);
+    return -1;
+  }
+  unsigned char chunk[4096];
+  size_t res;
+  while((res = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    stream_append(stream, chunk, res);
+  }
+  fclose(file);
+  return 0;
+}
+
+static int stream_save(s_stream* stream, const char* prefix, int index)
+{
+  char name[256];
+  snprintf(name, sizeof(name), "%s%d.raw", prefix, index);
+  FILE* file = fopen(name, "w");
+  if(!file)
+  {
+    fprintf(stderr, "can't open %s\n", name);
+    return -1;
+  }
+  fwrite(stream->data, 1, stream->length, file);
+  fclose(file);
+  return 0;
+}
+
+/*
+ * Returns the length of the packet starting at data,
+ * 0 if the data is too short, or -1 if the packet type is unknown.
+ */
+static int packet_length(const unsigned char* data, unsigned int available)
+{
+  switch(data[0])
+  {
+    case HCI_COMMAND_PKT:
+    case HCI_SCODATA_PKT:
+      return available > 3 ? data[3]+4 : 0;
+    case HCI_ACLDATA_PKT:
+      return available > 4 ? data[3]+(data[4] << 8)+5 : 0;
+    case HCI_EVENT_PKT:
+    case HCI_VENDOR_PKT:
+      return available > 2 ? data[2]+3 : 0;
+  }
+  return -1;
+}
+
+/*
+ * Split a stream into packets, skipping zero fillers and unknown bytes.
+ */
+static void stream_frame(s_stream* stream)
+{
+  unsigned int offset = 0;
+  unsigned int size = 0;
+
+  while(offset < stream->length)
+  {
+    int length = packet_length(stream->data + offset, stream->length - offset);
+    if(length < 0)
+    {
+      ++offset;
+      continue;
+    }
+    if(length == 0 || offset + length > stream->length)
+    {
+      break;
+    }
+    if(stream->packets_nb == size)
+    {
+      size = size ? size * 2 : 1024;
+      stream->packets = realloc(stream->packets, size * sizeof(*stream->packets));
+      if(!stream->packets)
+      {
+        fprintf(stderr, "can't allocate packets\n");
+        exit(-1);
+      }
+    }
+    stream->packets[stream->packets_nb].data = stream->data + offset;
+    stream->packets[stream->packets_nb].length = length;
+    ++stream->packets_nb;
+    offset += length;
+  }
+}
+
+/*
+ * Generate traffic similar to a DS4 connected to a PS4:
+ * input reports from the controller, output reports and HCI commands from the host,
+ * and the corresponding HCI events.
+ */
+static void stream_generate(unsigned int packets)
+{
+  unsigned char packet[128];
+  unsigned char counter = 0;
+  unsigned short timestamp = 0;
+  unsigned int i, j;
+
+  srand(1);
+
+  for(i=0; i<packets; )
+  {
+    int r = rand() % 100;
+    if(r < 80)
+    {
+      // DS4 input report on the interrupt channel
+      unsigned char report[] = { 0x02, 0x40, 0x20, 0x53, 0x00, 0x4f, 0x00, 0x41, 0x00, 0xa1, 0x11, 0xc0, 0x00 };
+      memset(packet, 0x00, sizeof(packet));
+      memcpy(packet, report, sizeof(report));
+      for(j=0; j<4; ++j)
+      {
+        packet[13+j] = 0x80 + rand() % 16 - 8;
+      }
+      packet[17] = 0x08;
+      packet[19] = counter << 2;
+      timestamp += 188;
+      packet[22] = timestamp & 0xff;
+      packet[23] = timestamp >> 8;
+      counter = (counter + 1) & 0x3f;
+      stream_append(streams + 1, packet, 0x53+5);
+      ++i;
+    }
+    else if(r < 90)
+    {
+      // DS4 output report from the host, then Number Of Completed Packets
+      unsigned char report[] = { 0x02, 0x40, 0x20, 0x51, 0x00, 0x4d, 0x00, 0x42, 0x00, 0x52, 0x11, 0x80, 0x00, 0xff };
+      memset(packet, 0x00, sizeof(packet));
+      memcpy(packet, report, sizeof(report));
+      stream_append(streams, packet, 0x51+5);
+      unsigned char nocp[] = { 0x04, 0x13, 0x05, 0x01, 0x40, 0x00, 0x01, 0x00 };
+      stream_append(streams + 1, nocp, sizeof(nocp));
+      i += 2;
+    }
+    else if(r < 95)
+    {
+      // HCI command, then Command Complete
+      unsigned char opcode = rand() % 8;
+      unsigned char command[] = { 0x01, 0x05 + opcode, 0x14, 0x02, 0x40, 0x00 };
+      stream_append(streams, command, sizeof(command));
+      unsigned char complete[] = { 0x04, 0x0e, 0x06, 0x01, 0x05 + opcode, 0x14, 0x00, 0x40, 0x00 };
+      stream_append(streams + 1, complete, sizeof(complete));
+      i += 2;
+    }
+    else
+    {
+      // zero fillers
+      memset(packet, 0x00, sizeof(packet));
+      stream_append(streams + rand() % RX_LINES, packet, 1 + rand() % 8);
+    }
+
+    /*
+     * Pad the shortest line with zero fillers, so that the lines stay aligned in time,
+     * and events are replayed after the packets they refer to.
+     */
+    s_stream* shortest = streams[0].length < streams[1].length ? streams : streams + 1;
+    s_stream* longest = streams[0].length < streams[1].length ? streams + 1 : streams;
+    unsigned int padding = longest->length - shortest->length;
+    memset(packet, 0x00, sizeof(packet));
+    while(padding)
+    {
+      unsigned int length = padding < sizeof(packet) ? padding : sizeof(packet);
+      stream_append(shortest, packet, length);
+      padding -= length;
+    }
+  }
+}
+
+/*
+ * Read command-line arguments.
+ */
+static void read_args(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, ":s:r:mw:pg:o:V")) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+        sniffer = optarg;
+        break;
+      case 'r':
+        rate = strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        sweep = 1;
+        break;
+      case 'w':
+        output = optarg;
+        break;
+      case 'p':
+        pipe_mode = 1;
+        break;
+      case 'g':
+        generate = strtoul(optarg, NULL, 10);
+        break;
+      case 'o':
+        save = optarg;
+        break;
+      case 'V':
+        vhci = 1;
+        break;
+      default: /* '?' */
+        usage();
+        break;
+    }
+  }
+
+  if(!rate)
+  {
+    usage();
+  }
+
+  if(generate)
+  {
+    stream_generate(generate);
+    if(save)
+    {
+      int i;
+      for(i=0; i<RX_LINES; ++i)
+      {
+        if(stream_save(streams + i, save, i) < 0)
+        {
+          exit(-1);
+        }
+      }
+    }
+  }
+  else
+  {
+    int i;
+    for(i=0; i<RX_LINES; ++i)
+    {
+      if(optind >= argc || !strcmp(argv[optind], "--"))
+      {
+        usage();
+      }
+      if(stream_load(streams + i, argv[optind++]) < 0)
+      {
+        exit(-1);
+      }
+    }
+  }
+
+  if(optind < argc && !strcmp(argv[optind], "--"))
+  {
+    ++optind;
+  }
+
+  extra_args = argv + optind;
+  extra_args_nb = argc - optind;
+}
+
+typedef struct
+{
+  int master;
+  int slave;
+  char* name;
+} s_pty;
+
+static int pty_open(s_pty* pty)
+{
+  pty->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(pty->master < 0 || grantpt(pty->master) < 0 || unlockpt(pty->master) < 0)
+  {
+    fprintf(stderr, "can't open a pseudo-terminal: %s\n", strerror(errno));
+    return -1;
+  }
+  pty->name = strdup(ptsname(pty->master));
+
+  /*
+   * Keep the slave side open, so that the master never sees a hangup,
+   * and make it raw before the sniffer opens it.
+   */
+  pty->slave = open(pty->name, O_RDWR | O_NOCTTY);
+  if(pty->slave < 0)
+  {
+    fprintf(stderr, "can't open %s: %s\n", pty->name, strerror(errno));
+    return -1;
+  }
+  struct termios options;
+  tcgetattr(pty->slave, &options);
+  cfmakeraw(&options);
+  tcsetattr(pty->slave, TCSANOW, &options);
+
+  return 0;
+}
+
+static void pty_close(s_pty* pty)
+{
+  close(pty->slave);
+  close(pty->master);
+  free(pty->name);
+}
+
+static double elapsed(struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+typedef struct
+{
+  unsigned int rate;
+  double duration;
+  unsigned long long written;
+  unsigned long long written_lines[RX_LINES];
+  unsigned long long overruns; /* bytes that did not fit in the pseudo-terminal */
+  double cpu;
+  unsigned int expected;
+  unsigned int captured;
+  unsigned int matched;
+  unsigned int dropped;
+  unsigned int corrupted;
+  int* latencies; /* us from the write of the last byte of a matched packet to its timestamp */
+  unsigned int latencies_nb;
+} s_result;
+
+static unsigned long long now_us()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+/*
+ * Record when the packets that end before the given stream offset were written.
+ */
+static void stream_written(s_stream* stream, unsigned int* next, unsigned int offset, unsigned long long written)
+{
+  while(*next < stream->packets_nb && stream->packets[*next].data + stream->packets[*next].length <= stream->data + offset)
+  {
+    stream->packets[*next].written = written;
+    ++*next;
+  }
+}
+
+/*
+ * Write the streams at the given rate, interleaving the lines.
+ * Bytes that can't be written because the sniffer does not read fast enough are dropped,
+ * as a real UART would do.
+ */
+static void replay(s_pty ptys[RX_LINES], s_result* result)
+{
+  unsigned int offsets[RX_LINES] = {};
+  unsigned int next[RX_LINES] = {};
+  double bytes_per_second = rate / 10.0;
+  struct timespec start;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while(1)
+  {
+    int pending = 0;
+    unsigned long long allowed = elapsed(&start) * bytes_per_second;
+
+    for(i=0; i<RX_LINES; ++i)
+    {
+      s_stream* stream = streams + i;
+      while(offsets[i] < stream->length && offsets[i] < allowed)
+      {
+        unsigned int length = stream->length - offsets[i];
+        if(length > WRITE_CHUNK)
+        {
+          length = WRITE_CHUNK;
+        }
+        ssize_t res = write(ptys[i].master, stream->data + offsets[i], length);
+        if(res < 0)
+        {
+          if(errno != EAGAIN && errno != EINTR)
+          {
+            fprintf(stderr, "write error: %s\n", strerror(errno));
+            return;
+          }
+          res = length;
+          result->overruns += length;
+          stream_written(stream, next + i, offsets[i] + res, 0);
+        }
+        else
+        {
+          result->written += res;
+          result->written_lines[i] += res;
+          stream_written(stream, next + i, offsets[i] + res, now_us());
+        }
+        offsets[i] += res;
+      }
+      if(offsets[i] < stream->length)
+      {
+        pending = 1;
+      }
+    }
+
+    if(!pending)
+    {
+      break;
+    }
+
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = WRITE_CHUNK * 1e9 / bytes_per_second };
+    nanosleep(&delay, NULL);
+  }
+
+  result->duration = elapsed(&start);
+}
+
+/*
+ * Create a virtual controller, and return its index.
+ */
+static int vhci_open(int* index)
+{
+  unsigned char create[] = { HCI_VENDOR_PKT, 0x00 }; // primary controller
+  unsigned char response[4];
+
+  int fd = open("/dev/vhci", O_RDWR | O_NONBLOCK);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open /dev/vhci: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  if(write(fd, create, sizeof(create)) != sizeof(create) || poll(&pfd, 1, 2000) <= 0
+      || read(fd, response, sizeof(response)) != sizeof(response) || response[0] != HCI_VENDOR_PKT)
+  {
+    fprintf(stderr, "can't create a virtual controller\n");
+    close(fd);
+    return -1;
+  }
+
+  *index = response[2] | response[3] << 8;
+
+  return fd;
+}
+
+/*
+ * Write the packets of the controller line to the virtual controller at the given rate.
+ * The packets the host stack sends to it are read and ignored.
+ */
+static void replay_vhci(int fd, s_result* result)
+{
+  s_stream* stream = streams + 1;
+  double bytes_per_second = rate / 10.0;
+  unsigned char discard[4096];
+  struct timespec start;
+  unsigned int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(i=0; i<stream->packets_nb; ++i)
+  {
+    s_packet* packet = stream->packets + i;
+    unsigned long long allowed = elapsed(&start) * bytes_per_second;
+    unsigned long long offset = packet->data - stream->data;
+
+    if(offset > allowed)
+    {
+      struct timespec delay = { .tv_sec = 0, .tv_nsec = (offset - allowed) * 1e9 / bytes_per_second };
+      nanosleep(&delay, NULL);
+    }
+
+    while(read(fd, discard, sizeof(discard)) > 0) {}
+
+    if(write(fd, packet->data, packet->length) != packet->length)
+    {
+      result->overruns += packet->length;
+      packet->written = 0;
+      continue;
+    }
+
+    packet->written = now_us();
+    result->written += packet->length;
+    result->written_lines[1] += packet->length;
+  }
+
+  result->duration = elapsed(&start);
+}
+
+static unsigned char* capture_load(const char* name, unsigned int* length)
+{
+  struct stat st;
+  unsigned char* data = NULL;
+  FILE* file = fopen(name, "r");
+
+  if(!file || fstat(fileno(file), &st) < 0)
+  {
+    fprintf(stderr, "can't open %s\n", name);
+  }
+  else if(!(data = malloc(st.st_size)) || fread(data, 1, st.st_size, file) != (size_t)st.st_size)
+  {
+    fprintf(stderr, "can't read %s\n", name);
+    free(data);
+    data = NULL;
+  }
+  else
+  {
+    *length = st.st_size;
+  }
+
+  if(file)
+  {
+    fclose(file);
+  }
+
+  return data;
+}
+
+/*
+ * Match each captured packet against the next expected packets of each line.
+ * Expected packets that are skipped are dropped, captured packets that match nothing are corrupted.
+ */
+static int check(s_result* result)
+{
+  unsigned int length;
+  unsigned char* data = capture_load(output, &length);
+  unsigned int next[RX_LINES] = {};
+  unsigned int offset = 24; // pcap header
+  int i;
+
+  if(!data)
+  {
+    return -1;
+  }
+
+  for(i=0; i<RX_LINES; ++i)
+  {
+    result->expected += streams[i].packets_nb;
+  }
+
+  result->latencies = malloc(result->expected * sizeof(*result->latencies));
+  if(!result->latencies)
+  {
+    fprintf(stderr, "can't allocate latencies\n");
+    free(data);
+    return -1;
+  }
+
+  while(offset + 16 <= length)
+  {
+    unsigned int incl_len = data[offset+8] | data[offset+9] << 8 | data[offset+10] << 16 | data[offset+11] << 24;
+    if(incl_len < 4 || offset + 16 + incl_len > length)
+    {
+      break;
+    }
+    unsigned char* packet = data + offset + 20; // record header + direction
+    unsigned int packet_length = incl_len - 4;
+
+    if(vhci && !(data[offset+16] | data[offset+17] | data[offset+18] | data[offset+19]))
+    {
+      // sent by the host stack itself
+      offset += 16 + incl_len;
+      continue;
+    }
+
+    ++result->captured;
+
+    for(i=0; i<RX_LINES; ++i)
+    {
+      s_stream* stream = streams + i;
+      unsigned int j;
+      for(j=next[i]; j<stream->packets_nb && j<next[i]+MATCH_WINDOW; ++j)
+      {
+        if(stream->packets[j].length == packet_length && !memcmp(stream->packets[j].data, packet, packet_length))
+        {
+          break;
+        }
+      }
+      if(j<stream->packets_nb && j<next[i]+MATCH_WINDOW)
+      {
+        next[i] = j + 1;
+        ++result->matched;
+        if(stream->packets[j].written)
+        {
+          unsigned int ts_sec = data[offset] | data[offset+1] << 8 | data[offset+2] << 16 | data[offset+3] << 24;
+          unsigned int ts_usec = data[offset+4] | data[offset+5] << 8 | data[offset+6] << 16 | data[offset+7] << 24;
+          long long latency = ts_sec * 1000000LL + ts_usec - (long long)stream->packets[j].written;
+          result->latencies[result->latencies_nb++] = latency;
+        }
+        break;
+      }
+    }
+    if(i == RX_LINES)
+    {
+      ++result->corrupted;
+    }
+
+    offset += 16 + incl_len;
+  }
+
+  result->dropped = result->expected - result->matched;
+
+  free(data);
+
+  return 0;
+}
+
+static int run(s_result* result)
+{
+  s_pty ptys[RX_LINES];
+  int i;
+
+  free(result->latencies);
+  memset(result, 0x00, sizeof(*result));
+  result->rate = rate;
+
+  int vhci_fd = -1;
+  int vhci_index = 0;
+  char vhci_arg[8];
+
+  if(vhci)
+  {
+    vhci_fd = vhci_open(&vhci_index);
+    if(vhci_fd < 0)
+    {
+      return -1;
+    }
+    snprintf(vhci_arg, sizeof(vhci_arg), "%d", vhci_index);
+  }
+  else
+  {
+    for(i=0; i<RX_LINES; ++i)
+    {
+      if(pty_open(ptys + i) < 0)
+      {
+        return -1;
+      }
+    }
+  }
+
+  char* args[9 + extra_args_nb];
+  int nb = 0;
+  args[nb++] = sniffer;
+  if(vhci)
+  {
+    args[nb++] = "-M";
+    args[nb++] = vhci_arg;
+  }
+  else
+  {
+    args[nb++] = "-0";
+    args[nb++] = ptys[0].name;
+    args[nb++] = "-1";
+    args[nb++] = ptys[1].name;
+  }
+  if(!pipe_mode)
+  {
+    args[nb++] = "-w";
+    args[nb++] = output;
+  }
+  for(i=0; i<extra_args_nb; ++i)
+  {
+    args[nb++] = extra_args[i];
+  }
+  args[nb] = NULL;
+
+  pid_t pid = fork();
+  if(pid < 0)
+  {
+    fprintf(stderr, "fork: %s\n", strerror(errno));
+    return -1;
+  }
+  if(!pid)
+  {
+    int out = pipe_mode ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open("/dev/null", O_WRONLY);
+    dup2(out, STDOUT_FILENO);
+    execv(sniffer, args);
+    fprintf(stderr, "can't execute %s: %s\n", sniffer, strerror(errno));
+    _exit(-1);
+  }
+
+  // let the sniffer open and flush the ports
+  usleep(500000);
+
+  if(vhci)
+  {
+    replay_vhci(vhci_fd, result);
+  }
+  else
+  {
+    replay(ptys, result);
+  }
+
+  // let the sniffer process the remaining data
+  usleep(500000);
+
+  kill(pid, SIGINT);
+
+  int status;
+  struct rusage usage;
+  if(wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+  {
+    fprintf(stderr, "sniffer failed\n");
+    return -1;
+  }
+
+  result->cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+  if(vhci)
+  {
+    close(vhci_fd);
+  }
+  else
+  {
+    for(i=0; i<RX_LINES; ++i)
+    {
+      pty_close(ptys + i);
+    }
+  }
+
+  return check(result);
+}
+
+static int compare_int(const void* a, const void* b)
+{
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  return (x > y) - (x < y);
+}
+
+static void print_result(s_result* result)
+{
+  double megabytes = result->written / 1e6;
+
+  printf("rate: %u bps, replayed %llu bytes in %.3fs (%.0f and %.0f bps on lines 0 and 1)\n", result->rate, result->written,
+      result->duration, result->written_lines[0] * 10 / result->duration, result->written_lines[1] * 10 / result->duration);
+  if(result->overruns)
+  {
+    printf("  overruns: %llu byte(s)\n", result->overruns);
+  }
+  printf("  cpu: %.3fs (%.1f%%, %.3fs/MB)\n", result->cpu, 100 * result->cpu / result->duration,
+      megabytes > 0 ? result->cpu / megabytes : 0);
+  printf("  packets: %u expected, %u captured, %u matched, %u dropped, %u corrupted\n", result->expected,
+      result->captured, result->matched, result->dropped, result->corrupted);
+  if(result->latencies_nb)
+  {
+    unsigned int nb = result->latencies_nb;
+    long long sum = 0;
+    unsigned int i;
+    qsort(result->latencies, nb, sizeof(*result->latencies), compare_int);
+    for(i=0; i<nb; ++i)
+    {
+      sum += result->latencies[i];
+    }
+    printf("  latency (write to timestamp, us): mean=%.0f p50=%d p99=%d max=%d\n", (double)sum / nb,
+        result->latencies[nb / 2], result->latencies[nb * 99 / 100], result->latencies[nb - 1]);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  s_result result = {};
+  int i;
+
+  read_args(argc, argv);
+
+  for(i=0; i<RX_LINES; ++i)
+  {
+    stream_frame(streams + i);
+  }
+
+  if(vhci)
+  {
+    // the host packets can't be injected
+    streams[0].packets_nb = 0;
+  }
+
+  if(!sweep)
+  {
+    if(run(&result) < 0)
+    {
+      return -1;
+    }
+    print_result(&result);
+    return (result.dropped || result.corrupted) ? 1 : 0;
+  }
+
+  unsigned int sustained = 0;
+
+  while(1)
+  {
+    if(run(&result) < 0)
+    {
+      return -1;
+    }
+    print_result(&result);
+    if(result.dropped || result.corrupted || result.overruns)
+    {
+      break;
+    }
+    sustained = rate;
+    if(rate > 0xffffffff / 2)
+    {
+      break;
+    }
+    rate *= 2;
+  }
+
+  if(sustained)
+  {
+    printf("max sustainable rate: %u bps\n", sustained);
+  }
+  else
+  {
+    printf("max sustainable rate: below %u bps\n", result.rate);
+  }
+
+  return 0;
+}
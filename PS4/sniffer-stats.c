@@ -0,0 +1,226 @@
+/*
+ License: GPLv3
+
+ Prints the live statistics the sniffer publishes into shared memory (sniffer -S name),
+ without slowing it down: the counters are only read.
+
+ Compile: gcc -o sniffer-stats sniffer-stats.c -lrt
+ Run:
+ $ ./sniffer-stats -n /sniffer-stats
+ $ ./sniffer-stats -n /sniffer-stats -i 100 -s
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "sniffer-stats.h"
+
+static const char* type_names[STATS_TYPES] = { "cmd", "acl", "sco", "evt", "iso", "other" };
+
+static char* name = "/sniffer-stats";
+static unsigned int interval = 1000; // ms
+static int sizes = 0;
+
+static volatile int done = 0;
+
+void terminate(int sig)
+{
+  done = 1;
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sniffer-stats [-n name] [-i ms] [-s]\n");
+  fprintf(stderr, "  -n: shared memory name given to sniffer -S (default: /sniffer-stats)\n");
+  fprintf(stderr, "  -i: refresh interval (default: 1000)\n");
+  fprintf(stderr, "  -s: print the packet size histograms\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads command-line arguments.
+ */
+static void read_args(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, ":n:i:s")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        name = optarg;
+        break;
+      case 'i':
+        interval = strtoul(optarg, NULL, 10);
+        if(!interval)
+        {
+          usage();
+        }
+        break;
+      case 's':
+        sizes = 1;
+        break;
+      default: /* '?' */
+        usage();
+        break;
+    }
+  }
+}
+
+static s_stats_page* stats_open()
+{
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open shared memory %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < STATS_PAGE_SIZE)
+  {
+    fprintf(stderr, "bad shared memory %s\n", name);
+    close(fd);
+    return NULL;
+  }
+
+  s_stats_page* page = mmap(NULL, STATS_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(page == MAP_FAILED)
+  {
+    fprintf(stderr, "can't map shared memory %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  if(__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || page->version != STATS_VERSION)
+  {
+    fprintf(stderr, "bad shared memory %s\n", name);
+    munmap(page, STATS_PAGE_SIZE);
+    return NULL;
+  }
+
+  return page;
+}
+
+/*
+ * Copy the counters, each with a single load, so that none is torn.
+ */
+static void snapshot(s_stats_page* page, s_stats_page* copy)
+{
+  const uint64_t* from = (const uint64_t*)page;
+  uint64_t* to = (uint64_t*)copy;
+  unsigned int i;
+
+  for(i=0; i<sizeof(*copy)/sizeof(*to); ++i)
+  {
+    to[i] = __atomic_load_n(from + i, __ATOMIC_RELAXED);
+  }
+}
+
+static void print(s_stats_page* current, s_stats_page* previous, double seconds)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  double uptime = (now.tv_sec * 1000000ULL + now.tv_usec - current->start) / 1e6;
+  int i, j;
+
+  printf("--- %.1fs\n", uptime);
+
+  for(i=0; i<STATS_LINES; ++i)
+  {
+    s_stats_line* line = current->lines + i;
+    s_stats_line* before = previous->lines + i;
+    char types[STATS_TYPES * 24] = "";
+    int length = 0;
+    uint64_t packets = 0;
+
+    for(j=0; j<STATS_TYPES; ++j)
+    {
+      uint64_t count = line->packets[j] - before->packets[j];
+      packets += count;
+      length += snprintf(types + length, sizeof(types) - length, " %s=%.0f", type_names[j], count / seconds);
+    }
+
+    printf("(%d) %.1f kB/s, %.0f packet(s)/s:%s\n", i, (line->bytes - before->bytes) / seconds / 1000, packets / seconds, types);
+    printf("(%d) fillers %.0f B/s, resyncs %llu (%llu byte(s) lost), queue overflows %llu\n", i,
+        (line->skipped - before->skipped) / seconds, (unsigned long long)line->resyncs,
+        (unsigned long long)line->lost, (unsigned long long)line->overflows);
+
+    if(sizes)
+    {
+      char histogram[STATS_SIZE_BINS * 24] = "";
+      length = 0;
+      for(j=0; j<STATS_SIZE_BINS; ++j)
+      {
+        if(line->sizes[j])
+        {
+          // the last bin is open-ended
+          length += snprintf(histogram + length, sizeof(histogram) - length, j < STATS_SIZE_BINS - 1 ? " <%u:%llu" : " >=%u:%llu",
+              j < STATS_SIZE_BINS - 1 ? 1 << j : 1 << (j - 1), (unsigned long long)line->sizes[j]);
+        }
+      }
+      printf("(%d) sizes:%s\n", i, histogram);
+    }
+  }
+
+  printf("merge: %.0f packet(s)/s, %.0f filtered/s, writer queue %u/%u chunk(s), %u dropped\n",
+      (current->merged - previous->merged) / seconds, (current->filtered - previous->filtered) / seconds,
+      current->writer_queued, current->writer_chunks, current->writer_dropped);
+
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+  (void) signal(SIGINT, terminate);
+
+  read_args(argc, argv);
+
+  s_stats_page* page = stats_open();
+  if(!page)
+  {
+    exit(-1);
+  }
+
+  static s_stats_page current, previous;
+  snapshot(page, &previous);
+
+  struct timeval last;
+  gettimeofday(&last, NULL);
+
+  while(!done)
+  {
+    usleep(interval * 1000);
+
+    if(__atomic_load_n(&page->closed, __ATOMIC_ACQUIRE) || (kill(page->pid, 0) < 0 && errno == ESRCH))
+    {
+      break;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double seconds = (now.tv_sec - last.tv_sec) + (now.tv_usec - last.tv_usec) / 1e6;
+    last = now;
+
+    snapshot(page, &current);
+
+    print(&current, &previous, seconds);
+
+    previous = current;
+  }
+
+  munmap(page, STATS_PAGE_SIZE);
+
+  return 0;
+}
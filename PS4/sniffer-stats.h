@@ -0,0 +1,50 @@
+/*
+ License: GPLv3
+
+ Layout of the shared memory page the sniffer publishes its live statistics into (sniffer -S name),
+ and that sniffer-stats reads.
+ Any change of the layout has to bump STATS_VERSION.
+ */
+
+#ifndef SNIFFER_STATS_H_
+#define SNIFFER_STATS_H_
+
+#include <stdint.h>
+
+#define STATS_MAGIC 0x53534e53
+#define STATS_VERSION 2
+#define STATS_PAGE_SIZE 4096
+#define STATS_LINES 2
+#define STATS_TYPES 6 /* command, ACL, SCO, event, ISO, other */
+#define STATS_SIZE_BINS 17 /* bin n counts packet lengths in [2^(n-1), 2^n[, the last one all lengths from 2^15 */
+
+typedef struct
+{
+  uint64_t bytes; /* read from the line */
+  uint64_t packets[STATS_TYPES];
+  uint64_t sizes[STATS_SIZE_BINS];
+  uint64_t skipped; /* zero fillers */
+  uint64_t resyncs;
+  uint64_t lost; /* bytes dropped while resynchronizing */
+  uint64_t overflows; /* packets dropped because the merge queue was full */
+} __attribute__((aligned(64))) s_stats_line;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t closed;
+  uint64_t start; /* us */
+  s_stats_line lines[STATS_LINES];
+  /* written by the main thread */
+  uint64_t merged;
+  uint64_t filtered;
+  uint32_t writer_queued; /* chunks waiting for the writer thread */
+  uint32_t writer_chunks;
+  uint32_t writer_dropped;
+} s_stats_page;
+
+_Static_assert(sizeof(s_stats_page) <= STATS_PAGE_SIZE, "the statistics don't fit in the shared memory page");
+
+#endif /* SNIFFER_STATS_H_ */
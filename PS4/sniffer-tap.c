@@ -0,0 +1,293 @@
+/*
+ License: GPLv3
+
+ Reads the packets the sniffer publishes into shared memory (sniffer -T name),
+ without slowing it down: each instance has its own read cursor.
+
+ Compile: gcc -o sniffer-tap sniffer-tap.c -lrt
+ Run:
+ $ ./sniffer-tap -n /sniffer | wireshark -k -i -
+ $ ./sniffer-tap -n /sniffer -w filename
+ $ ./sniffer-tap -n /sniffer -p
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#define TAP_MAGIC 0x47534e54
+#define TAP_HEADER_SIZE 4096
+#define TAP_PADDING 0xffffffff
+#define TAP_MAX_RECORD 65536
+#define TAP_POLL_PERIOD 1000 //us
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t size; /* size of the data area */
+  uint64_t head; /* bytes published since the start */
+  uint32_t closed;
+} s_tap_header;
+
+typedef struct
+{
+  uint32_t length; /* payload length, or TAP_PADDING up to the end of the data area */
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t direction;
+} s_tap_record;
+
+#define TAP_ALIGN(LENGTH) (((LENGTH) + 7) & ~7)
+
+typedef struct pcap_hdr_s {
+  uint32_t magic_number; /* magic number */
+  uint16_t version_major; /* major version number */
+  uint16_t version_minor; /* minor version number */
+  int32_t thiszone; /* GMT to local correction */
+  uint32_t sigfigs; /* accuracy of timestamps */
+  uint32_t snaplen; /* max length of captured packets, in octets */
+  uint32_t network; /* data link type */
+} pcap_hdr_t;
+
+typedef struct pcaprec_hdr_s {
+  uint32_t ts_sec; /* timestamp seconds */
+  uint32_t ts_usec; /* timestamp microseconds */
+  uint32_t incl_len; /* number of octets of packet saved in file */
+  uint32_t orig_len; /* actual length of packet */
+} pcaprec_hdr_t;
+
+static pcap_hdr_t capture_header =
+{
+  .magic_number = 0xa1b2c3d4,
+  .version_major = 0x0002,
+  .version_minor = 0x0004,
+  .thiszone = 0x00000000,
+  .sigfigs = 0x00000000,
+  .snaplen = 0x0000FFFF,
+  .network = 0x000000C9, //DLT_BLUETOOTH_HCI_H4_WITH_PHDR
+};
+
+static char* name = "/sniffer";
+static char* filename = NULL;
+static int print = 0;
+
+static volatile int done = 0;
+
+void terminate(int sig)
+{
+  done = 1;
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sniffer-tap [-n name] [-w filename | -p]\n");
+  fprintf(stderr, "  -n: shared memory name given to sniffer -T (default: /sniffer)\n");
+  fprintf(stderr, "  -w: write packets to a pcap file instead of stdout\n");
+  fprintf(stderr, "  -p: print a line per packet instead of writing a pcap stream\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads command-line arguments.
+ */
+static void read_args(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, ":n:w:p")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        name = optarg;
+        break;
+      case 'w':
+        filename = optarg;
+        break;
+      case 'p':
+        print = 1;
+        break;
+      default: /* '?' */
+        usage();
+        break;
+    }
+  }
+}
+
+static s_tap_header* tap_open()
+{
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open shared memory %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < TAP_HEADER_SIZE)
+  {
+    fprintf(stderr, "bad shared memory %s\n", name);
+    close(fd);
+    return NULL;
+  }
+
+  s_tap_header* tap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(tap == MAP_FAILED)
+  {
+    fprintf(stderr, "can't map shared memory %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  if(__atomic_load_n(&tap->magic, __ATOMIC_ACQUIRE) != TAP_MAGIC || TAP_HEADER_SIZE + tap->size > st.st_size)
+  {
+    fprintf(stderr, "bad shared memory %s\n", name);
+    munmap(tap, st.st_size);
+    return NULL;
+  }
+
+  return tap;
+}
+
+static void output(FILE* file, s_tap_record* record, unsigned char* data)
+{
+  if(print)
+  {
+    fprintf(file, "%u.%06u %s type=0x%02x length=%u\n", record->ts_sec, record->ts_usec,
+        record->direction ? "rx" : "tx", record->length ? data[0] : 0, record->length);
+    return;
+  }
+
+  pcaprec_hdr_t packet_header =
+  {
+    .ts_sec = record->ts_sec,
+    .ts_usec = record->ts_usec,
+    .incl_len = sizeof(record->direction) + record->length,
+    .orig_len = sizeof(record->direction) + record->length,
+  };
+
+  fwrite(&packet_header, 1, sizeof(packet_header), file);
+  fwrite(&record->direction, 1, sizeof(record->direction), file);
+  fwrite(data, 1, record->length, file);
+}
+
+int main(int argc, char* argv[])
+{
+  (void) signal(SIGINT, terminate);
+  (void) signal(SIGPIPE, terminate);
+
+  read_args(argc, argv);
+
+  s_tap_header* tap = tap_open();
+  if(!tap)
+  {
+    exit(-1);
+  }
+
+  FILE* file = stdout;
+  if(filename)
+  {
+    file = fopen(filename, "w");
+    if(!file)
+    {
+      fprintf(stderr, "can't open %s\n", filename);
+      exit(-1);
+    }
+  }
+
+  if(!print)
+  {
+    fwrite(&capture_header, 1, sizeof(capture_header), file);
+  }
+
+  unsigned char* area = (unsigned char*)tap + TAP_HEADER_SIZE;
+  unsigned int size = tap->size;
+  static unsigned char data[TAP_MAX_RECORD];
+  unsigned long long lost = 0;
+  unsigned long long packets = 0;
+
+  // start from the live position
+  uint64_t cursor = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+
+  while(!done)
+  {
+    uint64_t head = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+
+    if(cursor == head)
+    {
+      if(__atomic_load_n(&tap->closed, __ATOMIC_ACQUIRE))
+      {
+        break;
+      }
+      fflush(file);
+      usleep(TAP_POLL_PERIOD);
+      continue;
+    }
+
+    if(head - cursor > size - TAP_MAX_RECORD)
+    {
+      // the producer overwrote the data at the cursor
+      lost += head - cursor;
+      cursor = head;
+      continue;
+    }
+
+    unsigned int offset = cursor & (size - 1);
+
+    /*
+     * A padding marker can be a lone length at the end of the data area:
+     * read the whole header only if it's not one.
+     */
+    if(__atomic_load_n(&((s_tap_record*)(area + offset))->length, __ATOMIC_RELAXED) == TAP_PADDING)
+    {
+      cursor += size - offset;
+      continue;
+    }
+
+    s_tap_record record = *(s_tap_record*)(area + offset);
+
+    if(record.length > sizeof(data))
+    {
+      cursor = head;
+      continue;
+    }
+
+    memcpy(data, area + offset + sizeof(record), record.length);
+
+    /*
+     * Make sure the producer did not overwrite the record while it was copied.
+     */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&tap->head, __ATOMIC_RELAXED);
+    if(head - cursor > size - TAP_MAX_RECORD)
+    {
+      lost += head - cursor;
+      cursor = head;
+      continue;
+    }
+
+    output(file, &record, data);
+    ++packets;
+
+    cursor += TAP_ALIGN(sizeof(record) + record.length);
+  }
+
+  fflush(file);
+
+  if(filename)
+  {
+    fclose(file);
+  }
+
+  fprintf(stderr, "%llu packet(s), %llu byte(s) lost\n", packets, lost);
+
+  return 0;
+}
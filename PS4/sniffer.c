@@ -2,14 +2,27 @@
  Copyright (c) 2013 Mathieu Laurendeau <mat.lau@laposte.net>
  License: GPLv3
 
- Compile: gcc -o sniffer sniffer.c
+ Compile: gcc -o sniffer sniffer.c -lpthread -lm -lrt -lz
  Run:
  $ ./sniffer | wireshark -k -i -
  $ ./sniffer -w filename
+ $ ./sniffer -w filename -C 100 -G 3600 -W 24
+ $ ./sniffer -w filename -z 1
+ $ ./sniffer -w filename -F 10:5
+ $ ./sniffer -w filename -P 2,3
+ $ ./sniffer -w filename -L 1 -O auto
+ $ ./sniffer -M 0 -w filename
+ $ ./sniffer -A -f type=acl,cid=0x0041 -w filename
+ $ ./sniffer -S /sniffer-stats -w filename & ./sniffer-stats -n /sniffer-stats
+ $ ./sniffer -H 10 -f type=acl,data=a1:11 -w filename
+ $ ./sniffer -T /sniffer -w filename & ./sniffer-tap -n /sniffer | wireshark -k -i -
+ $ ./sniffer -f type=acl,cid=0x0041,data=a1:11 -w filename
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,15 +31,31 @@
 #include <signal.h>
 
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
 
 #include <termios.h>
 
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include <errno.h>
 
 #include <sched.h>
+#include <pthread.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "sniffer-stats.h"
 
 #define PORT1 "/dev/ttyUSB0"
 #define PORT2 "/dev/ttyUSB1"
@@ -36,6 +65,45 @@
  */
 #define TTY_BAUDRATE B3000000 //3Mbps
 
+/*
+ * The time to receive a byte on a line, in ns (8N1: 10 bits).
+ */
+#define TTY_BYTE_TIME (10 * 1000000000ULL / 3000000)
+
+#define RX_LINES 2
+#define BUFFER_SIZE 8192
+
+/*
+ * Read batching (-R): the tty driver waits for VMIN bytes, or VTIME tenths of a second
+ * after a byte, before waking the reader. -1 leaves the current settings.
+ */
+static int serial_vmin = -1;
+static int serial_vtime = -1;
+
+/*
+ * Ask the serial driver to push received bytes immediately (-l).
+ * Usb-serial FTDI drivers also set their latency timer to 1ms.
+ */
+static int serial_low_latency = 0;
+
+static void serial_set_low_latency(int fd, char* portname)
+{
+  struct serial_struct serial;
+
+  if(ioctl(fd, TIOCGSERIAL, &serial) < 0)
+  {
+    fprintf(stderr, "can't get serial info of %s: %s\n", portname, strerror(errno));
+    return;
+  }
+
+  serial.flags |= ASYNC_LOW_LATENCY;
+
+  if(ioctl(fd, TIOCSSERIAL, &serial) < 0)
+  {
+    fprintf(stderr, "can't set low latency mode on %s: %s\n", portname, strerror(errno));
+  }
+}
+
 /*
  * Connect to a serial port.
  */
@@ -54,12 +122,21 @@ int serial_connect(char* portname)
     cfsetispeed(&options, TTY_BAUDRATE);
     cfsetospeed(&options, TTY_BAUDRATE);
     cfmakeraw(&options);
+    if(serial_vmin >= 0)
+    {
+      options.c_cc[VMIN] = serial_vmin;
+      options.c_cc[VTIME] = serial_vtime;
+    }
     if(tcsetattr(fd, TCSANOW, &options) < 0)
     {
       fprintf(stderr, "can't set serial port options\n");
       close(fd);
       fd = -1;
     }
+    else if(serial_low_latency)
+    {
+      serial_set_low_latency(fd, portname);
+    }
     tcflush(fd, TCIFLUSH);
   }
 
@@ -109,338 +186,4054 @@ typedef struct _pcap_bluetooth_h4_header {
 
 static pcaprec_hdr_t packet_header = {};
 
-static FILE* file = NULL;
 static char* filename = NULL;
 
-void pcapwriter_init()
+static char* ports[] = { PORT1, PORT2 };
+
+/*
+ * Dump each packet through the log ring.
+ */
+static int debug = 0;
+
+/*
+ * Start a thread with the given attributes.
+ * Signals are blocked in the new thread, so that they interrupt the main loop.
+ */
+static int start_thread(pthread_t* thread, pthread_attr_t* attr, void* (*routine)(void*), void* arg)
 {
-  if(filename)
-  {
-    file = fopen(filename, "w");
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
 
-    if(!file)
-    {
-      fprintf(stderr, "pcapwriter_init");
-    }
-    else
-    {
-      fwrite((char*)&capture_header, 1, sizeof(capture_header), file);
-    }
-  }
-  else
-  {
-    write(fileno(stdout), &capture_header, sizeof(capture_header));
-  }
+  int ret = pthread_create(thread, attr, routine, arg);
+
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  return ret ? -1 : 0;
 }
 
-void pcapwriter_close()
+/*
+ * Start a thread that must not compete with the real-time reader.
+ */
+static int start_low_priority_thread(pthread_t* thread, void* (*routine)(void*))
 {
-  if(file)
-  {
-    fclose(file);
-  }
+  pthread_attr_t attr;
+  struct sched_param p = { .sched_priority = 0 };
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &p);
+
+  int ret = start_thread(thread, &attr, routine, NULL);
+
+  pthread_attr_destroy(&attr);
+
+  return ret;
 }
 
-static unsigned char buffer[1000000];
-static unsigned int total = 0;
+/*
+ * Diagnostic messages are formatted into lock-free single-producer rings,
+ * one per thread that logs (the main thread, the line readers and the flight recorder dump),
+ * and printed by a low-priority thread.
+ * If a ring is full, messages are dropped rather than delaying the reader.
+ */
+#define LOG_RING_SIZE (4*1024*1024)
+#define LOG_MESSAGE_MAX 256
+#define LOG_DRAIN_PERIOD 10000 //us
+#define LOG_PRODUCERS (2 + RX_LINES)
+#define LOG_HELPER (1 + RX_LINES)
 
-void store_data(void* from, unsigned int length)
+typedef struct
 {
-  if(total + length >= sizeof(buffer))
-  {
-    fwrite((char*)buffer, 1, total, file);
-    total = 0;
-  }
+  char data[LOG_RING_SIZE];
+  unsigned int head; /* written by the producer */
+  unsigned int tail; /* written by the consumer */
+  unsigned int dropped;
+} s_log_ring;
 
-  memcpy(buffer+total, from, length);
-  total += length;
-}
+static struct
+{
+  s_log_ring rings[LOG_PRODUCERS];
+  pthread_t thread;
+  volatile int exit;
+} log_ring = {};
 
-void pcapwriter_write(struct timeval* tv, unsigned int direction, unsigned short data_length, unsigned char data[data_length])
+/*
+ * The ring of the calling thread.
+ */
+static __thread s_log_ring* log_current = log_ring.rings;
+
+static void log_copy(s_log_ring* ring, unsigned int position, const void* from, unsigned int length)
 {
-  pcap_bluetooth_h4_header bt_h4_hdr =
+  unsigned int offset = position % LOG_RING_SIZE;
+  unsigned int size = LOG_RING_SIZE - offset;
+  if(size > length)
   {
-    .direction = direction
-  };
+    size = length;
+  }
+  memcpy(ring->data + offset, from, size);
+  memcpy(ring->data, (const char*)from + size, length - size);
+}
 
-  packet_header.ts_sec = tv->tv_sec;
-  packet_header.ts_usec = tv->tv_usec;
+static void log_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
 
-  packet_header.incl_len = sizeof(bt_h4_hdr)+data_length;
-  packet_header.orig_len = sizeof(bt_h4_hdr)+data_length;
+static void log_printf(const char* format, ...)
+{
+  char message[LOG_MESSAGE_MAX];
+  va_list ap;
 
-  if(file)
+  va_start(ap, format);
+  int length = vsnprintf(message, sizeof(message), format, ap);
+  va_end(ap);
+
+  if(length < 0)
   {
-    store_data(&packet_header, sizeof(packet_header));
-    store_data(&bt_h4_hdr, sizeof(bt_h4_hdr));
-    store_data(data, data_length);
+    return;
   }
-  else
+  if(length >= (int)sizeof(message))
+  {
+    length = sizeof(message) - 1;
+  }
+
+  s_log_ring* ring = log_current;
+  unsigned short size = length;
+  unsigned int head = ring->head;
+  unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  if(head - tail + sizeof(size) + size > LOG_RING_SIZE)
   {
-    write(fileno(stdout), &packet_header, sizeof(packet_header));
-    write(fileno(stdout), &bt_h4_hdr, sizeof(bt_h4_hdr));
-    write(fileno(stdout), data, data_length);
+    ++ring->dropped;
+    return;
   }
+
+  log_copy(ring, head, &size, sizeof(size));
+  log_copy(ring, head + sizeof(size), message, size);
+
+  __atomic_store_n(&ring->head, head + sizeof(size) + size, __ATOMIC_RELEASE);
 }
 
-static void usage()
+static void log_drain(s_log_ring* ring, FILE* out)
 {
-  fprintf(stderr, "Usage: sniffer [-w filename]\n");
-  exit(EXIT_FAILURE);
+  char message[LOG_MESSAGE_MAX];
+  unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  unsigned int tail = ring->tail;
+
+  while(tail != head)
+  {
+    unsigned short size;
+    unsigned int offset = tail % LOG_RING_SIZE;
+    unsigned int i;
+    for(i=0; i<sizeof(size); ++i)
+    {
+      ((char*)&size)[i] = ring->data[(offset + i) % LOG_RING_SIZE];
+    }
+    for(i=0; i<size; ++i)
+    {
+      message[i] = ring->data[(offset + sizeof(size) + i) % LOG_RING_SIZE];
+    }
+    fwrite(message, 1, size, out);
+    tail += sizeof(size) + size;
+  }
+
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 }
 
-/*
- * Reads command-line arguments.
- */
-static void read_args(int argc, char* argv[])
+static void* log_thread(void* arg)
 {
-  int opt;
+  FILE* out = filename ? stdout : stderr;
 
-  while ((opt = getopt(argc, argv, ":w:")) != -1)
+  while(1)
   {
-    switch (opt)
+    int exit = log_ring.exit;
+    unsigned int i;
+
+    for(i=0; i<LOG_PRODUCERS; ++i)
     {
-      case 'w':
-        filename = optarg;
-        break;
-      default: /* '?' */
-        usage();
-        break;
+      log_drain(log_ring.rings + i, out);
+    }
+
+    fflush(out);
+
+    if(exit)
+    {
+      break;
     }
+
+    usleep(LOG_DRAIN_PERIOD);
   }
-}
 
-static volatile int done = 0;
+  return NULL;
+}
 
-void terminate(int sig)
+static void log_init()
 {
-  done = 1;
+  if(start_low_priority_thread(&log_ring.thread, log_thread) < 0)
+  {
+    fprintf(stderr, "can't create log thread\n");
+    exit(-1);
+  }
 }
 
-#define HCI_COMMAND_PKT         0x01
-#define HCI_ACLDATA_PKT         0x02
-#define HCI_SCODATA_PKT         0x03
-#define HCI_EVENT_PKT           0x04
-#define HCI_VENDOR_PKT          0xff
-
-#define RX_LINES 2
-#define BUFFER_SIZE 8192
-
-unsigned char buf[RX_LINES][BUFFER_SIZE] = {};
-unsigned int direction[RX_LINES] = {};
-int last[RX_LINES] = {};
-struct timeval tv[RX_LINES] = {};
+static void log_close()
+{
+  log_ring.exit = 1;
+  pthread_join(log_ring.thread, NULL);
+}
 
 /*
- * warning: enabling debug can lead to performance issues,
- * that will mostly result in decoding failure.
+ * Live tap: framed packets are published once into a ring in shared memory,
+ * and any number of local consumers can read them with their own cursor (see sniffer-tap.c).
+ * The producer never waits for consumers: a consumer that is too slow gets overwritten,
+ * and detects it from the head position.
  */
-int debug = 0;
+#define TAP_MAGIC 0x47534e54
+#define TAP_HEADER_SIZE 4096
+#define TAP_SIZE (16*1024*1024) /* must be a power of 2 */
+#define TAP_PADDING 0xffffffff
+#define TAP_MAX_RECORD 65536
 
-int read_packet(int index)
+typedef struct
 {
-  int offset = 0;
+  uint32_t magic;
+  uint32_t size; /* size of the data area */
+  uint64_t head; /* bytes published since the start */
+  uint32_t closed;
+} s_tap_header;
 
-  while(offset < last[index] && !buf[index][offset])
+typedef struct
+{
+  uint32_t length; /* payload length, or TAP_PADDING up to the end of the data area */
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t direction;
+} s_tap_record;
+
+#define TAP_ALIGN(LENGTH) (((LENGTH) + 7) & ~7)
+
+static char* tap_name = NULL;
+static s_tap_header* tap = NULL;
+
+static void tap_init()
+{
+  if(!tap_name)
   {
-    offset++;
+    return;
   }
 
-  if(filename && offset)
+  int fd = shm_open(tap_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if(fd < 0 || ftruncate(fd, TAP_HEADER_SIZE + TAP_SIZE) < 0)
   {
-    printf("(%d) skip: %d byte(s)\n", index, offset);
+    fprintf(stderr, "can't create shared memory %s: %s\n", tap_name, strerror(errno));
+    exit(-1);
   }
 
-  if(offset == last[index])
+  // populate the mapping now, so that publishing never faults
+  tap = mmap(NULL, TAP_HEADER_SIZE + TAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if(tap == MAP_FAILED)
   {
-    last[index] = 0;
-    return 0;
+    fprintf(stderr, "can't map shared memory %s: %s\n", tap_name, strerror(errno));
+    exit(-1);
   }
 
-  unsigned char type = buf[index][offset];
+  tap->size = TAP_SIZE;
+  tap->head = 0;
+  tap->closed = 0;
+  __atomic_store_n(&tap->magic, TAP_MAGIC, __ATOMIC_RELEASE);
+}
 
-  switch(type)
+static void ring_publish(s_tap_header* ring, struct timeval* tv, unsigned int direction, unsigned int length, const unsigned char* data)
+{
+  unsigned char* area = (unsigned char*)ring + TAP_HEADER_SIZE;
+  uint64_t head = ring->head;
+  unsigned int offset = head & (ring->size - 1);
+  unsigned int size = TAP_ALIGN(sizeof(s_tap_record) + length);
+
+  if(offset + size > ring->size)
   {
-    case HCI_COMMAND_PKT:
-      direction[index] = 0x00000000;
-      break;
-    case HCI_EVENT_PKT:
-      direction[index] = 0x01000000;
-      break;
+    // records are never split
+    ((s_tap_record*)(area + offset))->length = TAP_PADDING;
+    head += ring->size - offset;
+    offset = 0;
   }
 
-  unsigned int length = 0;
+  s_tap_record* record = (s_tap_record*)(area + offset);
+  record->length = length;
+  record->ts_sec = tv->tv_sec;
+  record->ts_usec = tv->tv_usec;
+  record->direction = direction;
+  memcpy(record + 1, data, length);
 
-  switch(type)
+  __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+static void tap_close()
+{
+  if(tap)
   {
-    case HCI_COMMAND_PKT:
-      if(last[index] > 3)
-      {
-        length = buf[index][offset+3]+4;
-      }
-      break;
-    case HCI_ACLDATA_PKT:
-      if(last[index] > 3)
-      {
-        length = buf[index][offset+3]+(buf[index][offset+4] << 8)+5;
-        if(length > BUFFER_SIZE)
-        {
-          fprintf(stderr, "length is higher than %d: %d\n", BUFFER_SIZE, length);
-          done = 1;
-        }
-      }
-      break;
-    case HCI_SCODATA_PKT:
-      if(last[index] > 3)
-      {
-        length = buf[index][offset+3]+4;
-      }
-      break;
-    case HCI_EVENT_PKT:
-      if(last[index] > 2)
-      {
-        length = buf[index][offset+2]+3;
-      }
-      break;
-    case HCI_VENDOR_PKT:
-      if(last[index] > 2)
-      {
-        length = buf[index][offset+2]+3;
-      }
-      break;
-    default:
-      fprintf(stderr, "unknown packet type: 0x%02x\n", type);
-      done = 1;
-      break;
+    __atomic_store_n(&tap->closed, 1, __ATOMIC_RELEASE);
+    munmap(tap, TAP_HEADER_SIZE + TAP_SIZE);
+    shm_unlink(tap_name);
   }
+}
+
+/*
+ * Capture statistics.
+ * Each counter has a single writer (the reader of its line, or the main thread),
+ * so it is updated with a plain relaxed store, and each line has its own cache lines.
+ * With -S, they live in a shared memory page that sniffer-stats reads while capturing (see sniffer-stats.h).
+ */
+_Static_assert(STATS_LINES == RX_LINES, "the statistics page has one entry per line");
+
+#define STATS_ADD(COUNTER, VALUE) __atomic_store_n(&(COUNTER), (COUNTER) + (VALUE), __ATOMIC_RELAXED)
+#define STATS_SET(COUNTER, VALUE) __atomic_store_n(&(COUNTER), (VALUE), __ATOMIC_RELAXED)
+
+static char* stats_name = NULL;
+static s_stats_page stats_private = {};
+static s_stats_page* stats = &stats_private;
+
+static void stats_init()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
 
-  if(!length)
+  if(stats_name)
   {
-    return 0;
+    int fd = shm_open(stats_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, STATS_PAGE_SIZE) < 0)
+    {
+      fprintf(stderr, "can't create shared memory %s: %s\n", stats_name, strerror(errno));
+      exit(-1);
+    }
+
+    stats = mmap(NULL, STATS_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(stats == MAP_FAILED)
+    {
+      fprintf(stderr, "can't map shared memory %s: %s\n", stats_name, strerror(errno));
+      exit(-1);
+    }
   }
 
-  if(last[index]-offset < length)
+  stats->version = STATS_VERSION;
+  stats->pid = getpid();
+  stats->start = now.tv_sec * 1000000ULL + now.tv_usec;
+  __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void stats_packet(int index, unsigned int length, const unsigned char* data)
+{
+  s_stats_line* line = stats->lines + index;
+  unsigned int type;
+
+  switch(data[0])
   {
-    return 0;
+    case 0x01: type = 0; break;
+    case 0x02: type = 1; break;
+    case 0x03: type = 2; break;
+    case 0x04: type = 3; break;
+    case 0x05: type = 4; break;
+    default: type = 5; break;
   }
+  STATS_ADD(line->packets[type], 1);
 
-  if(filename)
+  unsigned int bin = 0;
+  while(length >> bin && bin < STATS_SIZE_BINS - 1)
   {
-    printf("(%d) packet: type=0x%02x length=%d\n", index, type, length);
+    ++bin;
   }
+  STATS_ADD(line->sizes[bin], 1);
+}
 
-  if(debug)
+static void stats_close()
+{
+  if(stats != &stats_private)
   {
-    int j;
-    for(j=0; j<length; ++j)
-    {
-      if(!(j%8))
-      {
-        printf("\n");
-      }
-      printf("0x%02x ", buf[index][offset+j]);
-    }
-    printf("\n");
+    __atomic_store_n(&stats->closed, 1, __ATOMIC_RELEASE);
+    munmap(stats, STATS_PAGE_SIZE);
+    shm_unlink(stats_name);
+    stats = &stats_private;
   }
+}
 
-  pcapwriter_write(tv+index, direction[index], length, buf[index]);
+/*
+ * Flight recorder: the last packets are kept in a preallocated in-memory ring,
+ * and nothing is written in steady state.
+ * When a trigger fires (Disconnection Complete event, resync, or SIGUSR1),
+ * the packets from pre seconds before to post seconds after the trigger are dumped to a pcapng file.
+ */
+#define FLIGHT_BYTES_PER_SECOND (2*3000000/10) /* both lines at full speed */
+#define FLIGHT_SECONDS 256 /* max pre + post, power of 2 */
+#define HUGE_PAGE_SIZE (2*1024*1024)
 
-  memmove(buf[index], buf[index]+length, last[index]-length);
+#define HCI_EV_DISCONN_COMPLETE 0x05
 
-  last[index] -= length;
+typedef struct
+{
+  uint32_t sec;
+  uint64_t position; /* first record of the second */
+} s_flight_second;
 
-  return 1;
-}
+static struct
+{
+  unsigned int pre;
+  unsigned int post;
+  s_tap_header* ring;
+  size_t ring_size;
+  s_flight_second seconds[FLIGHT_SECONDS];
+  uint32_t last_sec;
+  volatile int signal;
+  const char* reason;
+  int pending;
+  struct timeval trigger;
+  pthread_t thread;
+  int thread_started;
+  unsigned int dumps;
+  unsigned int ignored; /* triggers that fired during a pending dump */
+} flight = {};
 
-int main(int argc, char* argv[])
+/*
+ * Dump job, owned by the dump thread.
+ */
+static struct
 {
-  (void) signal(SIGINT, terminate);
+  uint64_t position;
+  struct timeval begin;
+  struct timeval end;
+  const char* reason;
+  unsigned int index;
+  unsigned long long packets;
+  unsigned long long lost;
+} flight_dump = {};
 
-  struct sched_param p =
+static void flight_init()
+{
+  if(!flight.pre && !flight.post)
   {
-      .sched_priority = sched_get_priority_max(SCHED_FIFO)
-  };
-
-  sched_setscheduler(0, SCHED_FIFO, &p);
-
-  read_args(argc, argv);
+    return;
+  }
 
-  int fd1 = serial_connect(PORT1);
-  if(fd1 < 0)
+  if(flight.pre + flight.post >= FLIGHT_SECONDS / 2)
   {
+    fprintf(stderr, "the flight recorder window is limited to %d seconds\n", FLIGHT_SECONDS / 2 - 1);
     exit(-1);
   }
 
-  int fd2 = serial_connect(PORT2);
-  if(fd1 < 0)
+  /*
+   * Keep twice the window, so that a dump can run while new packets come in.
+   */
+  size_t size = TAP_HEADER_SIZE;
+  size_t area = HUGE_PAGE_SIZE;
+  while(area < 2 * (flight.pre + flight.post + 1) * (size_t)FLIGHT_BYTES_PER_SECOND)
   {
-    exit(-1);
+    area *= 2;
   }
-  
-  pcapwriter_init(argv[1]);
+  size += area;
+  size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
 
-  struct pollfd pfd[RX_LINES] =
+  flight.ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  if(flight.ring == MAP_FAILED)
   {
-      {.fd = fd1, .events = POLLIN},
-      {.fd = fd2, .events = POLLIN},
-  };
+    // no reserved huge pages: ask for transparent ones
+    flight.ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(flight.ring == MAP_FAILED)
+    {
+      fprintf(stderr, "can't allocate the flight recorder: %s\n", strerror(errno));
+      exit(-1);
+    }
+    madvise(flight.ring, size, MADV_HUGEPAGE);
+    memset(flight.ring, 0x00, size);
+  }
 
-  int res;
-  int i;
+  flight.ring_size = size;
+  flight.ring->magic = TAP_MAGIC;
+  flight.ring->size = area;
+}
 
-  while(!done)
+static void flight_signal(int sig)
+{
+  flight.signal = 1;
+}
+
+static void flight_trigger(const char* reason, struct timeval* tv)
+{
+  if(!flight.ring)
   {
-    if(poll(pfd, 2, -1) > 0)
-    {
-      for(i=0; i<RX_LINES; ++i)
+    return;
+  }
+  if(flight.pending)
+  {
+    ++flight.ignored;
+    return;
+  }
+  flight.pending = 1;
+  flight.reason = reason;
+  flight.trigger = *tv;
+  log_printf("flight recorder: %s trigger\n", reason);
+}
+
+static void pcapng_write_block(FILE* file, uint32_t type, const void* body, uint32_t length, const void* data, uint32_t data_length)
+{
+  static const unsigned char padding[4] = {};
+  uint32_t padded = (data_length + 3) & ~3;
+  uint32_t total = 12 + length + padded;
+  fwrite(&type, sizeof(type), 1, file);
+  fwrite(&total, sizeof(total), 1, file);
+  fwrite(body, 1, length, file);
+  fwrite(data, 1, data_length, file);
+  fwrite(padding, 1, padded - data_length, file);
+  fwrite(&total, sizeof(total), 1, file);
+}
+
+static int timeval_before(const struct timeval* a, uint32_t sec, uint32_t usec)
+{
+  return a->tv_sec < sec || (a->tv_sec == sec && a->tv_usec < usec);
+}
+
+static int timeval_after(const struct timeval* a, uint32_t sec, uint32_t usec)
+{
+  return a->tv_sec > sec || (a->tv_sec == sec && a->tv_usec > usec);
+}
+
+static void* flight_thread(void* arg)
+{
+  log_current = log_ring.rings + LOG_HELPER;
+
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "%s-%u.pcapng", filename, flight_dump.index);
+
+  FILE* file = fopen(name, "w");
+  if(!file)
+  {
+    fprintf(stderr, "can't open %s\n", name);
+    return NULL;
+  }
+
+  // section header block, with the trigger as a comment
+  char comment[64];
+  uint16_t comment_length = snprintf(comment, sizeof(comment), "trigger: %s", flight_dump.reason);
+  uint16_t comment_padded = (comment_length + 3) & ~3;
+  struct __attribute__((packed))
+  {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int64_t length;
+    uint16_t code;
+    uint16_t option_length;
+  } shb = { 0x1A2B3C4D, 1, 0, -1, 1, comment_length };
+  unsigned char options[sizeof(comment) + 4] = {};
+  memcpy(options, comment, comment_length);
+  // opt_endofopt
+  pcapng_write_block(file, 0x0A0D0D0A, &shb, sizeof(shb), options, comment_padded + 4);
+
+  // interface description block, microsecond resolution by default
+  struct
+  {
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+  } idb = { capture_header.network, 0, capture_header.snaplen };
+  pcapng_write_block(file, 0x00000001, &idb, sizeof(idb), NULL, 0);
+
+  s_tap_header* ring = flight.ring;
+  unsigned char* area = (unsigned char*)ring + TAP_HEADER_SIZE;
+  uint64_t cursor = flight_dump.position;
+  // direction + payload, up to a reassembled L2CAP frame (-A)
+  static unsigned char data[sizeof(uint32_t) + 0xffff];
+
+  while(1)
+  {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(cursor >= head)
+    {
+      break;
+    }
+    if(head - cursor > ring->size - TAP_MAX_RECORD)
+    {
+      // overwritten while dumping
+      flight_dump.lost += head - cursor;
+      break;
+    }
+
+    unsigned int offset = cursor & (ring->size - 1);
+    // a padding marker can be a lone length at the end of the data area
+    if(__atomic_load_n(&((s_tap_record*)(area + offset))->length, __ATOMIC_RELAXED) == TAP_PADDING)
+    {
+      cursor += ring->size - offset;
+      continue;
+    }
+    s_tap_record record = *(s_tap_record*)(area + offset);
+    if(record.length > sizeof(data) - sizeof(uint32_t))
+    {
+      // not written by ring_publish
+      break;
+    }
+    memcpy(data, &record.direction, sizeof(record.direction));
+    memcpy(data + sizeof(record.direction), area + offset + sizeof(record), record.length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if(head - cursor > ring->size - TAP_MAX_RECORD)
+    {
+      flight_dump.lost += head - cursor;
+      break;
+    }
+
+    if(timeval_before(&flight_dump.end, record.ts_sec, record.ts_usec))
+    {
+      break;
+    }
+    if(timeval_after(&flight_dump.begin, record.ts_sec, record.ts_usec))
+    {
+      cursor += TAP_ALIGN(sizeof(record) + record.length);
+      continue;
+    }
+
+    // enhanced packet block
+    uint64_t ts = record.ts_sec * 1000000ULL + record.ts_usec;
+    struct
+    {
+      uint32_t interface;
+      uint32_t ts_high;
+      uint32_t ts_low;
+      uint32_t caplen;
+      uint32_t len;
+    } epb = { 0, ts >> 32, ts & 0xffffffff, sizeof(record.direction) + record.length, sizeof(record.direction) + record.length };
+    pcapng_write_block(file, 0x00000006, &epb, sizeof(epb), data, epb.caplen);
+    ++flight_dump.packets;
+
+    cursor += TAP_ALIGN(sizeof(record) + record.length);
+  }
+
+  fclose(file);
+
+  log_printf("flight recorder: %s: %llu packet(s)%s\n", name, flight_dump.packets, flight_dump.lost ? ", some were overwritten" : "");
+
+  return NULL;
+}
+
+/*
+ * Start the dump if the post-trigger window is over.
+ */
+static void flight_check(struct timeval* now)
+{
+  if(!flight.pending || now->tv_sec < flight.trigger.tv_sec + flight.post
+      || (now->tv_sec == flight.trigger.tv_sec + flight.post && now->tv_usec < flight.trigger.tv_usec))
+  {
+    return;
+  }
+
+  if(flight.thread_started)
+  {
+    if(pthread_tryjoin_np(flight.thread, NULL))
+    {
+      // the previous dump is still running
+      return;
+    }
+    flight.thread_started = 0;
+  }
+
+  flight.pending = 0;
+
+  /*
+   * Start from the first second of the window that is still in the ring.
+   */
+  uint32_t sec;
+  uint64_t position = flight.ring->head;
+  for(sec = flight.trigger.tv_sec - flight.pre; sec <= flight.trigger.tv_sec; ++sec)
+  {
+    s_flight_second* second = flight.seconds + sec % FLIGHT_SECONDS;
+    if(second->sec == sec && flight.ring->head - second->position <= flight.ring->size - TAP_MAX_RECORD)
+    {
+      position = second->position;
+      break;
+    }
+  }
+
+  flight_dump.position = position;
+  flight_dump.begin.tv_sec = flight.trigger.tv_sec - flight.pre;
+  flight_dump.begin.tv_usec = flight.trigger.tv_usec;
+  flight_dump.end.tv_sec = flight.trigger.tv_sec + flight.post;
+  flight_dump.end.tv_usec = flight.trigger.tv_usec;
+  flight_dump.reason = flight.reason;
+  flight_dump.index = flight.dumps++;
+  flight_dump.packets = 0;
+  flight_dump.lost = 0;
+
+  if(start_low_priority_thread(&flight.thread, flight_thread) < 0)
+  {
+    fprintf(stderr, "can't create flight recorder thread\n");
+    return;
+  }
+
+  flight.thread_started = 1;
+}
+
+static void flight_record(struct timeval* tv, unsigned int direction, unsigned int length, const unsigned char* data)
+{
+  if(tv->tv_sec != flight.last_sec)
+  {
+    s_flight_second* second = flight.seconds + tv->tv_sec % FLIGHT_SECONDS;
+    second->sec = tv->tv_sec;
+    second->position = flight.ring->head;
+    flight.last_sec = tv->tv_sec;
+  }
+
+  ring_publish(flight.ring, tv, direction, length, data);
+
+  flight_check(tv);
+}
+
+/*
+ * Returns the poll timeout (ms) needed to start a pending dump on time.
+ */
+static int flight_timeout()
+{
+  if(flight.signal)
+  {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    flight.signal = 0;
+    flight_trigger("signal", &now);
+  }
+
+  if(!flight.pending)
+  {
+    return -1;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  flight_check(&now);
+
+  return flight.pending ? 100 : -1;
+}
+
+static void flight_close()
+{
+  if(flight.thread_started)
+  {
+    pthread_join(flight.thread, NULL);
+    flight.thread_started = 0;
+  }
+
+  if(flight.pending)
+  {
+    // dump what was captured after the trigger
+    struct timeval end = flight.trigger;
+    end.tv_sec += flight.post;
+    flight_check(&end);
+    if(flight.thread_started)
+    {
+      pthread_join(flight.thread, NULL);
+    }
+  }
+}
+
+/*
+ * Segment rotation, enabled by a size limit and/or a duration limit.
+ * Segments are named filename.N, and N wraps at files_nb if set.
+ */
+static unsigned long long rotate_size = 0;
+static unsigned int rotate_time = 0;
+static unsigned int files_nb = 0;
+
+/*
+ * In file mode, packets are stored into chunks that are written by a low-priority thread,
+ * so that disk writes never delay the serial reads.
+ * If the writer falls behind and no chunk is free, packets are dropped rather than waiting for it.
+ * Full chunks are a multiple of the block size, which allows writing them with O_DIRECT,
+ * and keeps the page cache out of the way.
+ */
+#define CHUNK_SIZE (1024*1024)
+#define CHUNKS_NB 8
+#define DIRECT_IO_ALIGN 4096
+
+typedef struct
+{
+  unsigned char* data;
+  unsigned int length;
+  unsigned int segment;
+  int last; /* last chunk of the segment */
+} s_chunk;
+
+static s_chunk chunks[CHUNKS_NB] = {};
+
+static struct
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  unsigned int queued; /* chunks waiting to be written */
+  unsigned int produced; /* index of the chunk being filled */
+  unsigned int consumed; /* index of the next chunk to write */
+  int exit;
+  int failed; /* the current segment could not be opened, its chunks are discarded */
+  unsigned int discarded; /* chunks discarded because of that */
+  unsigned int dropped; /* packets dropped because no chunk was free */
+} writer =
+{
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned int segment = 0;
+static unsigned long long segment_size = 0;
+static time_t segment_start = 0;
+
+static int writer_write(int fd, unsigned char* data, unsigned int length)
+{
+  while(length)
+  {
+    ssize_t res = write(fd, data, length);
+    if(res < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      fprintf(stderr, "write error: %s\n", strerror(errno));
+      return -1;
+    }
+    data += res;
+    length -= res;
+  }
+  return 0;
+}
+
+static void writer_close(int fd, unsigned char* data, unsigned int length)
+{
+  unsigned int aligned = length & ~(DIRECT_IO_ALIGN - 1);
+
+  writer_write(fd, data, aligned);
+
+  if(aligned < length)
+  {
+    // the tail is not a multiple of the block size: finish without O_DIRECT
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    writer_write(fd, data + aligned, length - aligned);
+  }
+
+  close(fd);
+}
+
+/*
+ * Optional compression, done by the writer thread.
+ * Each chunk is compressed into an independent gzip member, and the offsets of the members
+ * are listed in a sidecar index file, so that a segment can be decompressed from any chunk.
+ * If chunks pile up, they are stored without compression until the writer catches up.
+ */
+static struct
+{
+  int level;
+  z_stream stream;
+  z_stream stored;
+  unsigned char* buffer;
+  unsigned int buffer_size;
+  s_chunk out; /* aligned output staging, for O_DIRECT */
+  FILE* index;
+  unsigned long long raw_offset;
+  unsigned long long compressed_offset;
+  /* statistics */
+  unsigned long long raw_total;
+  unsigned long long compressed_total;
+  unsigned int stored_chunks;
+  struct timespec cpu;
+} compression = {};
+
+static void compression_init()
+{
+  if(deflateInit2(&compression.stream, compression.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK
+      || deflateInit2(&compression.stored, Z_NO_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    fprintf(stderr, "can't initialize compression\n");
+    exit(-1);
+  }
+  compression.buffer_size = deflateBound(&compression.stored, CHUNK_SIZE);
+  compression.buffer = malloc(compression.buffer_size);
+  if(!compression.buffer || posix_memalign((void**)&compression.out.data, DIRECT_IO_ALIGN, CHUNK_SIZE))
+  {
+    fprintf(stderr, "can't allocate compression buffers\n");
+    exit(-1);
+  }
+}
+
+static void compression_open(const char* name)
+{
+  char index[PATH_MAX + sizeof(".idx")];
+  snprintf(index, sizeof(index), "%s.idx", name);
+  compression.index = fopen(index, "w");
+  if(!compression.index)
+  {
+    fprintf(stderr, "can't open %s\n", index);
+  }
+  compression.raw_offset = 0;
+  compression.compressed_offset = 0;
+  compression.out.length = 0;
+}
+
+static void compression_output(int fd, unsigned char* data, unsigned int length)
+{
+  while(length)
+  {
+    unsigned int size = CHUNK_SIZE - compression.out.length;
+    if(size > length)
+    {
+      size = length;
+    }
+    memcpy(compression.out.data + compression.out.length, data, size);
+    compression.out.length += size;
+    data += size;
+    length -= size;
+    if(compression.out.length == CHUNK_SIZE)
+    {
+      writer_write(fd, compression.out.data, CHUNK_SIZE);
+      compression.out.length = 0;
+    }
+  }
+}
+
+static void compression_write(int fd, s_chunk* chunk)
+{
+  z_stream* stream = &compression.stream;
+
+  if(__atomic_load_n(&writer.queued, __ATOMIC_RELAXED) > CHUNKS_NB / 2)
+  {
+    stream = &compression.stored;
+    ++compression.stored_chunks;
+  }
+
+  deflateReset(stream);
+  stream->next_in = chunk->data;
+  stream->avail_in = chunk->length;
+  stream->next_out = compression.buffer;
+  stream->avail_out = compression.buffer_size;
+
+  if(deflate(stream, Z_FINISH) != Z_STREAM_END)
+  {
+    fprintf(stderr, "compression error\n");
+    return;
+  }
+
+  unsigned int length = compression.buffer_size - stream->avail_out;
+
+  if(compression.index)
+  {
+    fprintf(compression.index, "%llu %llu\n", compression.raw_offset, compression.compressed_offset);
+  }
+
+  compression.raw_offset += chunk->length;
+  compression.compressed_offset += length;
+  compression.raw_total += chunk->length;
+  compression.compressed_total += length;
+
+  compression_output(fd, compression.buffer, length);
+}
+
+static void compression_close(int fd)
+{
+  writer_close(fd, compression.out.data, compression.out.length);
+  compression.out.length = 0;
+  if(compression.index)
+  {
+    fclose(compression.index);
+    compression.index = NULL;
+  }
+}
+
+
+static int writer_open(unsigned int index)
+{
+  char name[PATH_MAX];
+
+  if(rotate_size || rotate_time)
+  {
+    snprintf(name, sizeof(name), "%s.%u%s", filename, files_nb ? index % files_nb : index, compression.level ? ".gz" : "");
+  }
+  else
+  {
+    snprintf(name, sizeof(name), "%s%s", filename, compression.level ? ".gz" : "");
+  }
+
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+  if(fd < 0 && errno == EINVAL)
+  {
+    // the filesystem does not support direct I/O
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open %s: %s\n", name, strerror(errno));
+  }
+  else if(compression.level)
+  {
+    compression_open(name);
+  }
+  return fd;
+}
+
+static void* writer_thread(void* arg)
+{
+  int fd = -1;
+  unsigned int current = 0;
+
+  if(compression.level)
+  {
+    compression_init();
+  }
+
+  while(1)
+  {
+    pthread_mutex_lock(&writer.mutex);
+    while(!writer.queued && !writer.exit)
+    {
+      pthread_cond_wait(&writer.cond, &writer.mutex);
+    }
+    if(!writer.queued)
+    {
+      pthread_mutex_unlock(&writer.mutex);
+      break;
+    }
+    pthread_mutex_unlock(&writer.mutex);
+
+    s_chunk* chunk = chunks + writer.consumed % CHUNKS_NB;
+
+    if(chunk->segment != current)
+    {
+      // each segment gets its own attempt to open its file
+      writer.failed = 0;
+    }
+
+    if(!writer.failed && (fd < 0 || chunk->segment != current))
+    {
+      current = chunk->segment;
+      fd = writer_open(current);
+      if(fd < 0)
+      {
+        // don't retry (and truncate) for each chunk of the segment
+        writer.failed = 1;
+      }
+    }
+
+    if(writer.failed)
+    {
+      ++writer.discarded;
+    }
+    else if(fd >= 0)
+    {
+      if(compression.level)
+      {
+        compression_write(fd, chunk);
+        if(chunk->last)
+        {
+          compression_close(fd);
+          fd = -1;
+        }
+      }
+      else if(chunk->last)
+      {
+        writer_close(fd, chunk->data, chunk->length);
+        fd = -1;
+      }
+      else
+      {
+        writer_write(fd, chunk->data, chunk->length);
+      }
+    }
+
+    ++writer.consumed;
+
+    pthread_mutex_lock(&writer.mutex);
+    --writer.queued;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.mutex);
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &compression.cpu);
+
+  return NULL;
+}
+
+/*
+ * Tells whether the chunk being filled can be handed over without waiting for the writer.
+ */
+static int writer_can_push()
+{
+  return __atomic_load_n(&writer.queued, __ATOMIC_ACQUIRE) < CHUNKS_NB - 1;
+}
+
+/*
+ * Tells whether length bytes can be stored without waiting for the writer:
+ * they fit in the chunk being filled without filling it (store_data hands a full chunk over),
+ * or it can be handed over.
+ */
+static int writer_room(unsigned int length)
+{
+  s_chunk* chunk = chunks + writer.produced % CHUNKS_NB;
+  return chunk->length + length < CHUNK_SIZE || writer_can_push();
+}
+
+/*
+ * Hand the chunk being filled over to the writer thread, and get the next one.
+ * While capturing, writer_room() is checked first, so this only waits at exit.
+ */
+static void writer_push(int last)
+{
+  s_chunk* chunk = chunks + writer.produced % CHUNKS_NB;
+  chunk->segment = segment;
+  chunk->last = last;
+
+  pthread_mutex_lock(&writer.mutex);
+  ++writer.queued;
+  ++writer.produced;
+  pthread_cond_signal(&writer.cond);
+  while(writer.queued == CHUNKS_NB)
+  {
+    pthread_cond_wait(&writer.cond, &writer.mutex);
+  }
+  pthread_mutex_unlock(&writer.mutex);
+
+  chunks[writer.produced % CHUNKS_NB].length = 0;
+}
+
+void store_data(void* data, unsigned int length)
+{
+  s_chunk* chunk = chunks + writer.produced % CHUNKS_NB;
+  unsigned char* from = data;
+
+  segment_size += length;
+
+  while(length)
+  {
+    unsigned int size = CHUNK_SIZE - chunk->length;
+    if(size > length)
+    {
+      size = length;
+    }
+    memcpy(chunk->data + chunk->length, from, size);
+    chunk->length += size;
+    from += size;
+    length -= size;
+
+    if(chunk->length == CHUNK_SIZE)
+    {
+      writer_push(0);
+      chunk = chunks + writer.produced % CHUNKS_NB;
+    }
+  }
+}
+
+/*
+ * In pipe mode, records are batched, and the batch is written with a single syscall
+ * when it reaches a size threshold, or when its first record gets older than a deadline.
+ */
+#define PIPE_BATCH_SIZE (64*1024)
+#define PIPE_BATCH_THRESHOLD (16*1024)
+
+static struct
+{
+  unsigned char data[PIPE_BATCH_SIZE];
+  unsigned int length;
+  struct timespec deadline;
+  unsigned int deadline_ms;
+  unsigned long long records;
+  unsigned long long writes;
+} pipe_batch =
+{
+  .deadline_ms = 10,
+};
+
+static void pipe_flush()
+{
+  if(pipe_batch.length)
+  {
+    writer_write(fileno(stdout), pipe_batch.data, pipe_batch.length);
+    pipe_batch.length = 0;
+    ++pipe_batch.writes;
+  }
+}
+
+static void pipe_store(const void* data, unsigned int length)
+{
+  memcpy(pipe_batch.data + pipe_batch.length, data, length);
+  pipe_batch.length += length;
+}
+
+static void pipe_write(pcaprec_hdr_t* header, pcap_bluetooth_h4_header* h4, unsigned short data_length, unsigned char* data)
+{
+  if(pipe_batch.length + sizeof(*header) + sizeof(*h4) + data_length > PIPE_BATCH_SIZE)
+  {
+    pipe_flush();
+  }
+
+  if(!pipe_batch.length)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &pipe_batch.deadline);
+    pipe_batch.deadline.tv_nsec += pipe_batch.deadline_ms * 1000000L;
+    pipe_batch.deadline.tv_sec += pipe_batch.deadline.tv_nsec / 1000000000L;
+    pipe_batch.deadline.tv_nsec %= 1000000000L;
+  }
+
+  pipe_store(header, sizeof(*header));
+  pipe_store(h4, sizeof(*h4));
+  pipe_store(data, data_length);
+  ++pipe_batch.records;
+
+  if(pipe_batch.length >= PIPE_BATCH_THRESHOLD || !pipe_batch.deadline_ms)
+  {
+    pipe_flush();
+  }
+}
+
+/*
+ * Returns the poll timeout (ms) needed to honour the batch deadline, and flushes the batch when it's due.
+ */
+static int pipe_timeout()
+{
+  if(!pipe_batch.length)
+  {
+    return -1;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  long long remaining = (pipe_batch.deadline.tv_sec - now.tv_sec) * 1000000LL
+      + (pipe_batch.deadline.tv_nsec - now.tv_nsec) / 1000;
+
+  if(remaining <= 0)
+  {
+    pipe_flush();
+    return -1;
+  }
+
+  return (remaining + 999) / 1000;
+}
+
+static void pcapwriter_segment_start(time_t now)
+{
+  segment_start = now;
+  segment_size = 0;
+  store_data(&capture_header, sizeof(capture_header));
+}
+
+void pcapwriter_init()
+{
+  if(filename && !flight.ring)
+  {
+    unsigned int i;
+    for(i=0; i<CHUNKS_NB; ++i)
+    {
+      if(posix_memalign((void**)&chunks[i].data, DIRECT_IO_ALIGN, CHUNK_SIZE))
+      {
+        fprintf(stderr, "can't allocate writer chunks\n");
+        exit(-1);
+      }
+    }
+
+    if(start_low_priority_thread(&writer.thread, writer_thread) < 0)
+    {
+      fprintf(stderr, "can't create writer thread\n");
+      exit(-1);
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    pcapwriter_segment_start(now.tv_sec);
+  }
+  else if(!tap_name && !flight.ring)
+  {
+    write(fileno(stdout), &capture_header, sizeof(capture_header));
+  }
+}
+
+void pcapwriter_close()
+{
+  if(filename && !flight.ring)
+  {
+    writer_push(1);
+
+    pthread_mutex_lock(&writer.mutex);
+    writer.exit = 1;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.mutex);
+
+    pthread_join(writer.thread, NULL);
+  }
+  else
+  {
+    pipe_flush();
+  }
+}
+
+/*
+ * Start a new segment if the next record would exceed the size limit,
+ * or if the current segment lasts for more than the duration limit.
+ * The rotation is postponed while no chunk is free.
+ */
+static void pcapwriter_rotate(struct timeval* tv, unsigned int record_length)
+{
+  if(((rotate_size && segment_size + record_length > rotate_size && segment_size > sizeof(capture_header))
+      || (rotate_time && tv->tv_sec - segment_start >= rotate_time)) && writer_can_push())
+  {
+    writer_push(1);
+    ++segment;
+    pcapwriter_segment_start(tv->tv_sec);
+  }
+}
+
+void pcapwriter_write(struct timeval* tv, unsigned int direction, unsigned short data_length, unsigned char data[data_length])
+{
+  pcap_bluetooth_h4_header bt_h4_hdr =
+  {
+    .direction = direction
+  };
+
+  packet_header.ts_sec = tv->tv_sec;
+  packet_header.ts_usec = tv->tv_usec;
+
+  packet_header.incl_len = sizeof(bt_h4_hdr)+data_length;
+  packet_header.orig_len = sizeof(bt_h4_hdr)+data_length;
+
+  if(tap)
+  {
+    ring_publish(tap, tv, direction, data_length, data);
+  }
+
+  if(flight.ring)
+  {
+    flight_record(tv, direction, data_length, data);
+  }
+  else if(filename)
+  {
+    pcapwriter_rotate(tv, sizeof(packet_header) + packet_header.incl_len);
+
+    if(!writer_room(sizeof(packet_header) + packet_header.incl_len))
+    {
+      ++writer.dropped;
+      return;
+    }
+
+    store_data(&packet_header, sizeof(packet_header));
+    store_data(&bt_h4_hdr, sizeof(bt_h4_hdr));
+    store_data(data, data_length);
+  }
+  else if(!tap_name)
+  {
+    pipe_write(&packet_header, &bt_h4_hdr, data_length, data);
+  }
+}
+
+#define HCI_COMMAND_PKT         0x01
+#define HCI_ACLDATA_PKT         0x02
+#define HCI_SCODATA_PKT         0x03
+#define HCI_EVENT_PKT           0x04
+#define HCI_ISODATA_PKT         0x05
+#define HCI_VENDOR_PKT          0xff
+
+/*
+ * A filter is a list of byte tests, compiled from an expression such as:
+ *   type=acl,handle=0x0040,cid=0x0041,data=a1:11
+ * All the tests of a filter have to succeed for a packet to match.
+ * Several filters can be given, a packet is kept if any of them matches.
+ * Without any filter, all packets are kept.
+ * For ACL packets, cid and data only match start fragments, as continuation fragments
+ * have no L2CAP header: with -A, they apply to whole frames.
+ */
+#define MAX_FILTERS 8
+#define MAX_FILTER_INSNS 32
+
+typedef struct
+{
+  unsigned short offset; /* offset of the tested byte, H4 type byte included */
+  unsigned char mask;
+  unsigned char value;
+  unsigned char negate; /* the test succeeds if the masked byte differs from the value */
+} s_filter_insn;
+
+typedef struct
+{
+  unsigned int insns_nb;
+  s_filter_insn insns[MAX_FILTER_INSNS];
+} s_filter;
+
+static s_filter filters[MAX_FILTERS] = {};
+static unsigned int filters_nb = 0;
+static unsigned int filtered = 0;
+
+static int filter_add_insn(s_filter* filter, unsigned short offset, unsigned char mask, unsigned char value, unsigned char negate)
+{
+  if(filter->insns_nb == MAX_FILTER_INSNS)
+  {
+    fprintf(stderr, "too many tests in filter\n");
+    return -1;
+  }
+  filter->insns[filter->insns_nb].offset = offset;
+  filter->insns[filter->insns_nb].mask = mask;
+  filter->insns[filter->insns_nb].value = value;
+  filter->insns[filter->insns_nb].negate = negate;
+  ++filter->insns_nb;
+  return 0;
+}
+
+static int filter_parse_type(const char* value)
+{
+  static const struct
+  {
+    const char* name;
+    unsigned char type;
+  } types[] =
+  {
+    { "cmd",    HCI_COMMAND_PKT },
+    { "acl",    HCI_ACLDATA_PKT },
+    { "sco",    HCI_SCODATA_PKT },
+    { "evt",    HCI_EVENT_PKT },
+    { "vendor", HCI_VENDOR_PKT },
+  };
+  unsigned int i;
+  for(i=0; i<sizeof(types)/sizeof(*types); ++i)
+  {
+    if(!strcmp(value, types[i].name))
+    {
+      return types[i].type;
+    }
+  }
+  char* end;
+  long type = strtol(value, &end, 0);
+  if(*value && !*end && type >= 0 && type <= 0xff)
+  {
+    return type;
+  }
+  return -1;
+}
+
+/*
+ * Compile a filter expression.
+ */
+static int filter_compile(char* expr)
+{
+  if(filters_nb == MAX_FILTERS)
+  {
+    fprintf(stderr, "too many filters\n");
+    return -1;
+  }
+
+  int type = -1;
+  long handle = -1;
+  long cid = -1;
+  char* data = NULL;
+
+  char* saveptr;
+  char* term;
+  for(term = strtok_r(expr, ",", &saveptr); term; term = strtok_r(NULL, ",", &saveptr))
+  {
+    char* value = strchr(term, '=');
+    if(!value)
+    {
+      fprintf(stderr, "bad filter term: %s\n", term);
+      return -1;
+    }
+    *(value++) = '\0';
+    if(!strcmp(term, "type"))
+    {
+      type = filter_parse_type(value);
+      if(type < 0)
+      {
+        fprintf(stderr, "bad packet type: %s\n", value);
+        return -1;
+      }
+    }
+    else if(!strcmp(term, "handle"))
+    {
+      char* end;
+      handle = strtol(value, &end, 0);
+      if(!*value || *end || handle < 0 || handle > 0x0fff)
+      {
+        fprintf(stderr, "bad handle: %s\n", value);
+        return -1;
+      }
+    }
+    else if(!strcmp(term, "cid"))
+    {
+      char* end;
+      cid = strtol(value, &end, 0);
+      if(!*value || *end || cid < 0 || cid > 0xffff)
+      {
+        fprintf(stderr, "bad cid: %s\n", value);
+        return -1;
+      }
+    }
+    else if(!strcmp(term, "data"))
+    {
+      data = value;
+    }
+    else
+    {
+      fprintf(stderr, "unknown filter term: %s\n", term);
+      return -1;
+    }
+  }
+
+  if(type < 0 && (handle >= 0 || cid >= 0 || data))
+  {
+    type = HCI_ACLDATA_PKT;
+  }
+
+  if(cid >= 0 && type != HCI_ACLDATA_PKT)
+  {
+    fprintf(stderr, "cid only applies to acl packets\n");
+    return -1;
+  }
+
+  if(handle >= 0 && type != HCI_ACLDATA_PKT && type != HCI_SCODATA_PKT)
+  {
+    fprintf(stderr, "handle only applies to acl and sco packets\n");
+    return -1;
+  }
+
+  s_filter* filter = filters + filters_nb;
+  filter->insns_nb = 0;
+
+  if(type >= 0 && filter_add_insn(filter, 0, 0xff, type, 0) < 0)
+  {
+    return -1;
+  }
+
+  if(handle >= 0)
+  {
+    if(filter_add_insn(filter, 1, 0xff, handle & 0xff, 0) < 0
+        || filter_add_insn(filter, 2, 0x0f, handle >> 8, 0) < 0)
+    {
+      return -1;
+    }
+  }
+
+  if(type == HCI_ACLDATA_PKT && (cid >= 0 || data))
+  {
+    // not a continuation fragment
+    if(filter_add_insn(filter, 2, 0x30, 0x10, 1) < 0)
+    {
+      return -1;
+    }
+  }
+
+  if(cid >= 0)
+  {
+    if(filter_add_insn(filter, 7, 0xff, cid & 0xff, 0) < 0
+        || filter_add_insn(filter, 8, 0xff, cid >> 8, 0) < 0)
+    {
+      return -1;
+    }
+  }
+
+  if(data)
+  {
+    /*
+     * Payload offsets: after the L2CAP header for ACL packets, after the HCI header otherwise.
+     */
+    unsigned short offset;
+    switch(type)
+    {
+      case HCI_ACLDATA_PKT:
+        offset = 9;
+        break;
+      case HCI_EVENT_PKT:
+      case HCI_VENDOR_PKT:
+        offset = 3;
+        break;
+      default:
+        offset = 4;
+        break;
+    }
+    char* saveptr2;
+    char* byte;
+    for(byte = strtok_r(data, ":", &saveptr2); byte; byte = strtok_r(NULL, ":", &saveptr2))
+    {
+      char* end;
+      long value = strtol(byte, &end, 16);
+      if(!*byte || *end || value < 0 || value > 0xff)
+      {
+        fprintf(stderr, "bad data byte: %s\n", byte);
+        return -1;
+      }
+      if(filter_add_insn(filter, offset++, 0xff, value, 0) < 0)
+      {
+        return -1;
+      }
+    }
+  }
+
+  ++filters_nb;
+
+  return 0;
+}
+
+/*
+ * Returns 1 if the packet has to be kept, 0 otherwise.
+ */
+static int filter_match(unsigned int length, const unsigned char* data)
+{
+  if(!filters_nb)
+  {
+    return 1;
+  }
+
+  unsigned int i, j;
+  for(i=0; i<filters_nb; ++i)
+  {
+    const s_filter* filter = filters + i;
+    for(j=0; j<filter->insns_nb; ++j)
+    {
+      const s_filter_insn* insn = filter->insns + j;
+      if(insn->offset >= length || ((data[insn->offset] & insn->mask) != insn->value) != insn->negate)
+      {
+        break;
+      }
+    }
+    if(j == filter->insns_nb)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Live analysis of the DS4 input reports (HID report 0x11 on an L2CAP channel).
+ * Reports are tracked per ACL connection handle,
+ * and the statistics are printed periodically and at exit.
+ */
+#define DS4_MAX_HANDLES 8
+#define DS4_HISTOGRAM_BINS 32 /* 1ms bins, the last one collects longer intervals */
+
+typedef struct
+{
+  unsigned short handle;
+  unsigned long long reports;
+  unsigned long long missing;
+  struct timeval last_tv;
+  unsigned char counter;
+  /* report interval in us */
+  unsigned long long intervals;
+  double mean;
+  double m2;
+  unsigned int min;
+  unsigned int max;
+  unsigned int last_interval;
+  double jitter; /* smoothed difference between consecutive intervals, as in RFC 3550 */
+  unsigned int histogram[DS4_HISTOGRAM_BINS];
+  /* last decoded state */
+  unsigned char sticks[4];
+  unsigned char triggers[2];
+  unsigned int buttons;
+  unsigned short timestamp;
+} s_ds4_stats;
+
+static s_ds4_stats ds4_stats[DS4_MAX_HANDLES] = {};
+static unsigned int ds4_stats_nb = 0;
+static unsigned int ds4_period = 0;
+static time_t ds4_next_print = 0;
+
+static s_ds4_stats* ds4_get_stats(unsigned short handle)
+{
+  unsigned int i;
+  for(i=0; i<ds4_stats_nb; ++i)
+  {
+    if(ds4_stats[i].handle == handle)
+    {
+      return ds4_stats + i;
+    }
+  }
+  if(ds4_stats_nb == DS4_MAX_HANDLES)
+  {
+    return NULL;
+  }
+  s_ds4_stats* stats = ds4_stats + ds4_stats_nb++;
+  stats->handle = handle;
+  stats->min = UINT_MAX;
+  return stats;
+}
+
+static void ds4_print()
+{
+  unsigned int i, j;
+  for(i=0; i<ds4_stats_nb; ++i)
+  {
+    s_ds4_stats* stats = ds4_stats + i;
+    log_printf("ds4 handle=0x%04x: %llu report(s), %llu missing\n", stats->handle, stats->reports, stats->missing);
+    if(stats->intervals)
+    {
+      log_printf("  interval (ms): mean=%.3f sd=%.3f min=%.3f max=%.3f jitter=%.3f\n", stats->mean / 1000,
+          stats->intervals > 1 ? sqrt(stats->m2 / (stats->intervals - 1)) / 1000 : 0,
+          stats->min / 1000.0, stats->max / 1000.0, stats->jitter / 1000);
+      char histogram[DS4_HISTOGRAM_BINS * 16] = "";
+      int length = 0;
+      for(j=0; j<DS4_HISTOGRAM_BINS; ++j)
+      {
+        if(stats->histogram[j])
+        {
+          length += snprintf(histogram + length, sizeof(histogram) - length, " %s%u:%u",
+              j == DS4_HISTOGRAM_BINS - 1 ? ">=" : "", j, stats->histogram[j]);
+        }
+      }
+      log_printf("  histogram (ms):%s\n", histogram);
+    }
+    log_printf("  state: lx=%u ly=%u rx=%u ry=%u l2=%u r2=%u hat=%u buttons=0x%04x counter=%u timestamp=%u\n",
+        stats->sticks[0], stats->sticks[1], stats->sticks[2], stats->sticks[3], stats->triggers[0], stats->triggers[1],
+        stats->buttons & 0x0f, stats->buttons >> 4, stats->counter, stats->timestamp);
+  }
+}
+
+static void ds4_analyse(struct timeval* tv, unsigned int length, const unsigned char* data)
+{
+  if(!ds4_period)
+  {
+    return;
+  }
+
+  if(tv->tv_sec >= ds4_next_print)
+  {
+    if(ds4_next_print)
+    {
+      ds4_print();
+    }
+    ds4_next_print = tv->tv_sec + ds4_period;
+  }
+
+  /*
+   * ACL start fragment on a dynamic channel, carrying a HID DATA|INPUT 0x11 report:
+   * 0x02 handle(2) length(2) l2cap_length(2) cid(2) 0xa1 0x11 flags(2) lx ly rx ry buttons(3) l2 r2 timestamp(2)
+   */
+  if(length < 25 || data[0] != HCI_ACLDATA_PKT || ((data[2] >> 4) & 0x03) == 0x01
+      || (data[7] | data[8] << 8) < 0x0040 || data[9] != 0xa1 || data[10] != 0x11)
+  {
+    return;
+  }
+
+  s_ds4_stats* stats = ds4_get_stats(data[1] | (data[2] & 0x0f) << 8);
+  if(!stats)
+  {
+    return;
+  }
+
+  unsigned char counter = data[19] >> 2;
+
+  if(stats->reports)
+  {
+    stats->missing += (counter - stats->counter - 1) & 0x3f;
+
+    unsigned int interval = (tv->tv_sec - stats->last_tv.tv_sec) * 1000000 + tv->tv_usec - stats->last_tv.tv_usec;
+
+    ++stats->intervals;
+    double delta = interval - stats->mean;
+    stats->mean += delta / stats->intervals;
+    stats->m2 += delta * (interval - stats->mean);
+    if(interval < stats->min)
+    {
+      stats->min = interval;
+    }
+    if(interval > stats->max)
+    {
+      stats->max = interval;
+    }
+    if(stats->intervals > 1)
+    {
+      int diff = interval - stats->last_interval;
+      stats->jitter += (abs(diff) - stats->jitter) / 16;
+    }
+    stats->last_interval = interval;
+
+    unsigned int bin = interval / 1000;
+    ++stats->histogram[bin < DS4_HISTOGRAM_BINS ? bin : DS4_HISTOGRAM_BINS - 1];
+  }
+
+  ++stats->reports;
+  stats->last_tv = *tv;
+  stats->counter = counter;
+  memcpy(stats->sticks, data + 13, sizeof(stats->sticks));
+  stats->buttons = data[17] | data[18] << 8 | (data[19] & 0x03) << 16;
+  memcpy(stats->triggers, data + 20, sizeof(stats->triggers));
+  stats->timestamp = data[22] | data[23] << 8;
+}
+
+/*
+ * Each line is read by its own real-time thread, pinned to its own core,
+ * so that a burst on one line does not delay the timestamps of the other.
+ * The readers frame packets into single-producer queues,
+ * and the main thread merges them in timestamp order.
+ */
+#define LINE_QUEUE_SIZE (4*1024*1024) /* power of 2 */
+#define LINE_QUEUE_PADDING 0xffffffff
+#define READER_IDLE_PERIOD 1 //ms
+
+typedef struct
+{
+  unsigned int length; /* packet length, or LINE_QUEUE_PADDING up to the end of the queue */
+  unsigned int arrival; /* order in which the readers queued the packets */
+  unsigned int resyncs; /* the line lost sync before this packet */
+  struct timeval tv;
+} s_line_record;
+
+typedef struct
+{
+  int fd;
+  int cpu;
+  pthread_t thread;
+  int started;
+  unsigned char queue[LINE_QUEUE_SIZE];
+  unsigned int head; /* written by the reader */
+  unsigned int tail; /* written by the merge */
+  uint64_t watermark; /* us, packets queued after it was set are not older */
+  unsigned int resyncs; /* not yet reported to the merge */
+  int offset; /* us subtracted from the timestamps */
+  int latency_timer; /* ms, of the usb-serial adapter, -1 if unknown */
+  unsigned long long reads;
+  unsigned long long bytes;
+  uint64_t first_read; /* us */
+  uint64_t last_read;
+  unsigned long long packets;
+  unsigned long long lag; /* sum of the timestamp lags, in ns */
+  unsigned int max_lag;
+  unsigned int max_read_delay; /* us between poll() returning and the timestamp */
+  unsigned int uring_rearms; /* multishot reads stopped by a lack of buffers */
+} s_reader;
+
+static s_reader readers[RX_LINES] =
+{
+  { .fd = -1, .cpu = -1, .latency_timer = -1 },
+  { .fd = -1, .cpu = -1, .latency_timer = -1 },
+};
+
+/*
+ * The latency timer of the usb-serial adapters (-L), in ms, -1 to leave it unchanged.
+ */
+static int latency_timer = -1;
+
+/*
+ * Read with io_uring instead of poll/read (-U).
+ */
+static int use_uring = 0;
+
+/*
+ * Capture from the HCI monitor channel of the given controller (-M), instead of the serial lines.
+ * -1 for the serial lines.
+ */
+static int monitor_index = -1;
+
+#define BTPROTO_HCI 1
+#define HCI_DEV_NONE 0xffff
+#define HCI_CHANNEL_MONITOR 2
+
+/*
+ * Reads, and sets if requested, the latency timer of the usb-serial adapter of a line.
+ * FTDI adapters hold received bytes up to this delay before sending them to the host,
+ * which delays the timestamps of small packets.
+ */
+static void latency_timer_setup(int index)
+{
+  char real[PATH_MAX];
+  char path[PATH_MAX + 64];
+
+  if(!realpath(ports[index], real))
+  {
+    return;
+  }
+
+  const char* name = strrchr(real, '/');
+  snprintf(path, sizeof(path), "/sys/bus/usb-serial/devices/%s/latency_timer", name ? name + 1 : real);
+
+  FILE* file;
+
+  if(latency_timer >= 0)
+  {
+    file = fopen(path, "w");
+    if(!file || fprintf(file, "%d\n", latency_timer) < 0 || fclose(file))
+    {
+      fprintf(stderr, "can't set the latency timer of %s\n", ports[index]);
+    }
+  }
+
+  file = fopen(path, "r");
+  if(file)
+  {
+    if(fscanf(file, "%d", &readers[index].latency_timer) != 1)
+    {
+      readers[index].latency_timer = -1;
+    }
+    fclose(file);
+  }
+}
+
+static struct
+{
+  int event; /* signaled by the readers when they queue packets */
+  unsigned int arrivals;
+  int held; /* the oldest packet waits for another line */
+  unsigned long long packets;
+  unsigned long long reordered; /* packets merged before some that were queued earlier */
+  unsigned int max_depth;
+  unsigned int max_hold; /* us between the timestamp and the merge */
+} merge = { .event = -1 };
+
+/*
+ * Correlation of the host and controller lines:
+ * HCI commands are matched with their Command Complete or Command Status event,
+ * and host ACL packets with the Number Of Completed Packets events.
+ * Latencies are kept per opcode and per handle, and printed periodically and at exit.
+ */
+#define HOST_LINE 0
+
+/*
+ * Number of command/event pairs needed to estimate the offset between the lines.
+ */
+#define CALIBRATION_SAMPLES 32
+
+#define HCI_EV_CMD_COMPLETE 0x0e
+#define HCI_EV_CMD_STATUS 0x0f
+#define HCI_EV_NUM_COMP_PKTS 0x13
+
+#define LATENCY_BINS 25 /* bin n counts latencies in [2^(n-1), 2^n[ us */
+
+typedef struct
+{
+  unsigned long long count;
+  double mean;
+  unsigned int min;
+  unsigned int max;
+  unsigned int histogram[LATENCY_BINS];
+} s_latency;
+
+#define CORR_MAX_OPCODES 64
+#define CORR_MAX_HANDLES 16
+#define CORR_PENDING 64 /* power of 2 */
+
+typedef struct
+{
+  unsigned short key; /* opcode or handle */
+  struct timeval pending[CORR_PENDING];
+  unsigned int head;
+  unsigned int tail;
+  s_latency latency;
+} s_corr_entry;
+
+static struct
+{
+  unsigned int period;
+  int calibrate; /* correct the offset of the controller line once estimated (-O auto) */
+  long long skew; /* min of event time - command time - event transfer time, in us */
+  unsigned int skew_samples;
+  time_t next_print;
+  s_corr_entry opcodes[CORR_MAX_OPCODES];
+  unsigned int opcodes_nb;
+  s_corr_entry handles[CORR_MAX_HANDLES];
+  unsigned int handles_nb;
+  unsigned long long unmatched;
+} corr = {};
+
+static void latency_add(s_latency* latency, unsigned int value)
+{
+  if(!latency->count || value < latency->min)
+  {
+    latency->min = value;
+  }
+  if(value > latency->max)
+  {
+    latency->max = value;
+  }
+  ++latency->count;
+  latency->mean += (value - latency->mean) / latency->count;
+  unsigned int bin = 0;
+  while(value && bin < LATENCY_BINS - 1)
+  {
+    value >>= 1;
+    ++bin;
+  }
+  ++latency->histogram[bin];
+}
+
+/*
+ * Returns an upper bound of the given percentile.
+ */
+static unsigned int latency_percentile(s_latency* latency, unsigned int percent)
+{
+  unsigned long long count = 0;
+  unsigned int bin;
+  for(bin=0; bin<LATENCY_BINS; ++bin)
+  {
+    count += latency->histogram[bin];
+    if(count * 100 >= latency->count * percent)
+    {
+      break;
+    }
+  }
+  return bin ? (1 << bin) : 1;
+}
+
+static void latency_print(const char* name, unsigned short key, s_latency* latency)
+{
+  log_printf("%s 0x%04x: %llu sample(s), latency (us): mean=%.0f min=%u max=%u p50<%u p99<%u\n",
+      name, key, latency->count, latency->mean, latency->min, latency->max,
+      latency_percentile(latency, 50), latency_percentile(latency, 99));
+}
+
+static s_corr_entry* corr_get(s_corr_entry* entries, unsigned int* nb, unsigned int max, unsigned short key)
+{
+  unsigned int i;
+  for(i=0; i<*nb; ++i)
+  {
+    if(entries[i].key == key)
+    {
+      return entries + i;
+    }
+  }
+  if(*nb == max)
+  {
+    return NULL;
+  }
+  entries[*nb].key = key;
+  return entries + (*nb)++;
+}
+
+static void corr_push(s_corr_entry* entry, struct timeval* tv)
+{
+  if(entry->head - entry->tail == CORR_PENDING)
+  {
+    // the oldest one will never be matched
+    ++entry->tail;
+    ++corr.unmatched;
+  }
+  entry->pending[entry->head++ % CORR_PENDING] = *tv;
+}
+
+/*
+ * Returns the latency in us, or LLONG_MIN if nothing was pending.
+ */
+static long long corr_pop(s_corr_entry* entry, struct timeval* tv)
+{
+  if(entry->head == entry->tail)
+  {
+    ++corr.unmatched;
+    return LLONG_MIN;
+  }
+  struct timeval* start = entry->pending + entry->tail++ % CORR_PENDING;
+  long long latency = (tv->tv_sec - start->tv_sec) * 1000000LL + tv->tv_usec - start->tv_usec;
+  latency_add(&entry->latency, latency > 0 ? latency : 0);
+  return latency;
+}
+
+/*
+ * An event can't end before the end of its command plus its own transfer time.
+ * The smallest difference is an upper bound of the offset between the controller line and the host line,
+ * reached when the controller answers immediately.
+ */
+static void corr_calibrate(long long latency, unsigned int length)
+{
+  if(latency == LLONG_MIN)
+  {
+    return;
+  }
+
+  long long skew = latency - (long long)(length * TTY_BYTE_TIME / 1000);
+
+  if(!corr.skew_samples || skew < corr.skew)
+  {
+    corr.skew = skew;
+  }
+  ++corr.skew_samples;
+
+  if(corr.calibrate && corr.skew_samples == CALIBRATION_SAMPLES)
+  {
+    s_reader* reader = readers + !HOST_LINE;
+    int offset = reader->offset + corr.skew;
+    // the reader keeps its timestamps and watermark monotonic across the jump
+    __atomic_store_n(&reader->offset, offset, __ATOMIC_RELAXED);
+    log_printf("calibration: line %d offset set to %d us\n", !HOST_LINE, offset);
+    corr.calibrate = 0;
+    corr.skew_samples = 0;
+  }
+}
+
+static void corr_print()
+{
+  unsigned int i;
+  for(i=0; i<corr.opcodes_nb; ++i)
+  {
+    if(corr.opcodes[i].latency.count)
+    {
+      latency_print("opcode", corr.opcodes[i].key, &corr.opcodes[i].latency);
+    }
+  }
+  for(i=0; i<corr.handles_nb; ++i)
+  {
+    if(corr.handles[i].latency.count)
+    {
+      latency_print("handle", corr.handles[i].key, &corr.handles[i].latency);
+    }
+  }
+  if(corr.unmatched)
+  {
+    log_printf("correlation: %llu unmatched packet(s)\n", corr.unmatched);
+  }
+  if(corr.skew_samples)
+  {
+    log_printf("calibration: line %d lags line %d by at most %lld us (%u sample(s), offset %d us)\n",
+        !HOST_LINE, HOST_LINE, corr.skew, corr.skew_samples, readers[!HOST_LINE].offset);
+  }
+}
+
+static void corr_analyse(int index, struct timeval* tv, unsigned int length, const unsigned char* data)
+{
+  s_corr_entry* entry;
+  unsigned int i;
+
+  if(!corr.period && !corr.calibrate)
+  {
+    return;
+  }
+
+  if(corr.period && tv->tv_sec >= corr.next_print)
+  {
+    if(corr.next_print)
+    {
+      corr_print();
+    }
+    corr.next_print = tv->tv_sec + corr.period;
+  }
+
+  switch(data[0])
+  {
+    case HCI_COMMAND_PKT:
+      entry = corr_get(corr.opcodes, &corr.opcodes_nb, CORR_MAX_OPCODES, data[1] | data[2] << 8);
+      if(entry)
+      {
+        corr_push(entry, tv);
+      }
+      break;
+    case HCI_ACLDATA_PKT:
+      if(index == HOST_LINE)
+      {
+        entry = corr_get(corr.handles, &corr.handles_nb, CORR_MAX_HANDLES, data[1] | (data[2] & 0x0f) << 8);
+        if(entry)
+        {
+          corr_push(entry, tv);
+        }
+      }
+      break;
+    case HCI_EVENT_PKT:
+      switch(data[1])
+      {
+        case HCI_EV_CMD_COMPLETE:
+          if(length >= 6)
+          {
+            // a zero opcode only updates the number of allowed commands
+            unsigned short opcode = data[4] | data[5] << 8;
+            if(opcode && (entry = corr_get(corr.opcodes, &corr.opcodes_nb, CORR_MAX_OPCODES, opcode)))
+            {
+              corr_calibrate(corr_pop(entry, tv), length);
+            }
+          }
+          break;
+        case HCI_EV_CMD_STATUS:
+          if(length >= 7)
+          {
+            unsigned short opcode = data[5] | data[6] << 8;
+            if(opcode && (entry = corr_get(corr.opcodes, &corr.opcodes_nb, CORR_MAX_OPCODES, opcode)))
+            {
+              corr_calibrate(corr_pop(entry, tv), length);
+            }
+          }
+          break;
+        case HCI_EV_NUM_COMP_PKTS:
+          for(i=0; length >= 4 && i<data[3] && 8+4*i <= length; ++i)
+          {
+            unsigned short handle = (data[4+4*i] | data[5+4*i] << 8) & 0x0fff;
+            unsigned short count = data[6+4*i] | data[7+4*i] << 8;
+            entry = corr_get(corr.handles, &corr.handles_nb, CORR_MAX_HANDLES, handle);
+            while(entry && count--)
+            {
+              corr_pop(entry, tv);
+            }
+          }
+          break;
+      }
+      break;
+  }
+}
+
+/*
+ * L2CAP reassembly: the ACL fragments of each line and handle are gathered into whole L2CAP frames,
+ * using buffers from a preallocated pool.
+ * Per channel statistics show the cost of the fragmentation (fragments per frame, reassembly latency).
+ * With -A, the frames are written instead of the fragments, as unfragmented ACL packets,
+ * since there is no link type for bare L2CAP frames with the HCI direction.
+ */
+#define L2CAP_MAX_HANDLES 16 /* per line */
+#define L2CAP_MAX_CHANNELS 32
+#define L2CAP_POOL_SIZE 8
+#define L2CAP_HEADER_SIZE 4
+#define ACL_HEADER_SIZE 5 /* with the H4 type */
+#define L2CAP_BUFFER_SIZE (ACL_HEADER_SIZE + L2CAP_HEADER_SIZE + 65535)
+
+typedef struct
+{
+  unsigned short handle;
+  unsigned char* buffer; /* NULL when no frame is in progress */
+  unsigned int expected; /* ACL header + L2CAP header + payload */
+  unsigned int received;
+  unsigned int fragments;
+  struct timeval first;
+} s_l2cap_context;
+
+typedef struct
+{
+  unsigned int key; /* line, handle and CID */
+  unsigned long long frames;
+  unsigned long long bytes;
+  unsigned long long fragments;
+  unsigned int max_fragments;
+  unsigned long long latency; /* us, from the first to the last fragment */
+  unsigned int max_latency;
+  struct timeval first;
+  struct timeval last;
+} s_l2cap_channel;
+
+static struct
+{
+  int enabled; /* -a */
+  int write; /* -A */
+  unsigned char pool[L2CAP_POOL_SIZE][L2CAP_BUFFER_SIZE];
+  unsigned char* free[L2CAP_POOL_SIZE];
+  unsigned int free_nb;
+  s_l2cap_context contexts[RX_LINES][L2CAP_MAX_HANDLES];
+  unsigned int contexts_nb[RX_LINES];
+  s_l2cap_channel channels[L2CAP_MAX_CHANNELS];
+  unsigned int channels_nb;
+  unsigned int truncated; /* frames interrupted by a new start fragment */
+  unsigned int orphans; /* continuation fragments without a start */
+  unsigned int overflows; /* fragments beyond the L2CAP length */
+  unsigned int no_buffer; /* frames lost because the pool was empty */
+  unsigned int oversized; /* frames longer than a pcap record can hold, not written */
+} l2cap = {};
+
+static void l2cap_init()
+{
+  unsigned int i;
+  for(i=0; i<L2CAP_POOL_SIZE; ++i)
+  {
+    l2cap.free[i] = l2cap.pool[i];
+  }
+  l2cap.free_nb = L2CAP_POOL_SIZE;
+}
+
+static s_l2cap_context* l2cap_get_context(int index, unsigned short handle)
+{
+  unsigned int i;
+  for(i=0; i<l2cap.contexts_nb[index]; ++i)
+  {
+    if(l2cap.contexts[index][i].handle == handle)
+    {
+      return l2cap.contexts[index] + i;
+    }
+  }
+  if(l2cap.contexts_nb[index] == L2CAP_MAX_HANDLES)
+  {
+    return NULL;
+  }
+  s_l2cap_context* context = l2cap.contexts[index] + l2cap.contexts_nb[index]++;
+  context->handle = handle;
+  return context;
+}
+
+static void l2cap_release(s_l2cap_context* context)
+{
+  if(context->buffer)
+  {
+    l2cap.free[l2cap.free_nb++] = context->buffer;
+    context->buffer = NULL;
+  }
+}
+
+static void l2cap_account(int index, unsigned short handle, struct timeval* tv, const unsigned char* frame,
+    unsigned int length, unsigned int fragments, struct timeval* first)
+{
+  unsigned short cid = frame[ACL_HEADER_SIZE + 2] | frame[ACL_HEADER_SIZE + 3] << 8;
+  unsigned int key = index << 28 | handle << 16 | cid;
+  s_l2cap_channel* channel = NULL;
+  unsigned int i;
+
+  for(i=0; i<l2cap.channels_nb; ++i)
+  {
+    if(l2cap.channels[i].key == key)
+    {
+      channel = l2cap.channels + i;
+      break;
+    }
+  }
+  if(!channel)
+  {
+    if(l2cap.channels_nb == L2CAP_MAX_CHANNELS)
+    {
+      return;
+    }
+    channel = l2cap.channels + l2cap.channels_nb++;
+    channel->key = key;
+    channel->first = *tv;
+  }
+
+  ++channel->frames;
+  channel->bytes += length - ACL_HEADER_SIZE - L2CAP_HEADER_SIZE;
+  channel->fragments += fragments;
+  if(fragments > channel->max_fragments)
+  {
+    channel->max_fragments = fragments;
+  }
+  long long latency = (tv->tv_sec - first->tv_sec) * 1000000LL + tv->tv_usec - first->tv_usec;
+  if(latency > 0)
+  {
+    channel->latency += latency;
+    if(latency > channel->max_latency)
+    {
+      channel->max_latency = latency;
+    }
+  }
+  channel->last = *tv;
+}
+
+/*
+ * Feeds an ACL packet to the reassembly of its line and handle.
+ * Returns 1 if a whole frame is available in *frame, as an unfragmented ACL packet.
+ * It is valid until the next call.
+ * Frames longer than 0xffff bytes (with the H4 type) are accounted but not returned:
+ * the writers take 16-bit lengths.
+ */
+static int l2cap_reassemble(int index, struct timeval* tv, unsigned int length, unsigned char* data,
+    unsigned char** frame, unsigned int* frame_length)
+{
+  unsigned short handle = (data[1] | data[2] << 8) & 0x0fff;
+  int start = ((data[2] >> 4) & 0x03) != 0x01;
+  unsigned char* payload = data + ACL_HEADER_SIZE;
+  unsigned int payload_length = length - ACL_HEADER_SIZE;
+
+  s_l2cap_context* context = l2cap_get_context(index, handle);
+  if(!context)
+  {
+    return 0;
+  }
+
+  if(start)
+  {
+    if(context->buffer)
+    {
+      ++l2cap.truncated;
+      l2cap_release(context);
+    }
+
+    if(payload_length < L2CAP_HEADER_SIZE)
+    {
+      return 0;
+    }
+
+    unsigned int expected = ACL_HEADER_SIZE + L2CAP_HEADER_SIZE + (payload[0] | payload[1] << 8);
+
+    if(length >= expected)
+    {
+      // not fragmented, no copy
+      l2cap_account(index, handle, tv, data, expected, 1, tv);
+      if(expected > 0xffff)
+      {
+        ++l2cap.oversized;
+        return 0;
+      }
+      *frame = data;
+      *frame_length = expected;
+      return 1;
+    }
+
+    if(!l2cap.free_nb)
+    {
+      ++l2cap.no_buffer;
+      return 0;
+    }
+
+    context->buffer = l2cap.free[--l2cap.free_nb];
+    memcpy(context->buffer, data, length);
+    context->expected = expected;
+    context->received = length;
+    context->fragments = 1;
+    context->first = *tv;
+    return 0;
+  }
+
+  if(!context->buffer)
+  {
+    ++l2cap.orphans;
+    return 0;
+  }
+
+  if(context->received + payload_length > context->expected)
+  {
+    ++l2cap.overflows;
+    l2cap_release(context);
+    return 0;
+  }
+
+  memcpy(context->buffer + context->received, payload, payload_length);
+  context->received += payload_length;
+  ++context->fragments;
+
+  if(context->received < context->expected)
+  {
+    return 0;
+  }
+
+  l2cap_account(index, handle, tv, context->buffer, context->expected, context->fragments, &context->first);
+
+  unsigned char* buffer = context->buffer;
+  unsigned int acl_length = context->expected - ACL_HEADER_SIZE;
+  l2cap_release(context);
+
+  if(context->expected > 0xffff)
+  {
+    ++l2cap.oversized;
+    return 0;
+  }
+
+  // start fragment with the whole length
+  buffer[2] = (buffer[2] & 0xcf) | 0x20;
+  buffer[3] = acl_length & 0xff;
+  buffer[4] = acl_length >> 8;
+  *frame = buffer;
+  *frame_length = context->expected;
+  return 1;
+}
+
+static void l2cap_print()
+{
+  unsigned int i;
+  for(i=0; i<l2cap.channels_nb; ++i)
+  {
+    s_l2cap_channel* channel = l2cap.channels + i;
+    double duration = (channel->last.tv_sec - channel->first.tv_sec) + (channel->last.tv_usec - channel->first.tv_usec) / 1e6;
+    log_printf("l2cap (%u) handle=0x%04x cid=0x%04x: %llu frame(s), %llu byte(s), %.1f kB/s, "
+        "%.2f fragment(s)/frame (max %u), reassembly (us): mean=%.0f max=%u\n",
+        channel->key >> 28, (channel->key >> 16) & 0x0fff, channel->key & 0xffff, channel->frames, channel->bytes,
+        duration > 0 ? channel->bytes / duration / 1000 : 0, (double)channel->fragments / channel->frames,
+        channel->max_fragments, (double)channel->latency / channel->frames, channel->max_latency);
+  }
+  if(l2cap.truncated || l2cap.orphans || l2cap.overflows || l2cap.no_buffer || l2cap.oversized)
+  {
+    log_printf("l2cap: %u truncated frame(s), %u orphan fragment(s), %u overflow(s), %u frame(s) lost (no buffer), "
+        "%u frame(s) too long to be written\n",
+        l2cap.truncated, l2cap.orphans, l2cap.overflows, l2cap.no_buffer, l2cap.oversized);
+  }
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: sniffer [-0 port] [-1 port] [-w filename [-C size] [-G seconds] [-W count] [-z level] [-F pre:post]] [-f filter]... [-T name] [-b ms] [-H seconds] [-c seconds] [-P cpu,cpu] [-L ms] [-O us|auto] [-R vmin,vtime] [-l] [-U] [-M index] [-a|-A] [-S name] [-d]\n");
+  fprintf(stderr, "  -0, -1: serial ports of lines 0 and 1 (default: %s and %s)\n", PORT1, PORT2);
+  fprintf(stderr, "  -C: start a new file when the current one reaches size MB\n");
+  fprintf(stderr, "  -G: start a new file every given number of seconds\n");
+  fprintf(stderr, "  -W: reuse file names after count files\n");
+  fprintf(stderr, "  -F: flight recorder: keep packets in memory, and on a trigger (disconnection, resync, SIGUSR1),\n");
+  fprintf(stderr, "      dump those from pre seconds before to post seconds after it to filename-N.pcapng\n");
+  fprintf(stderr, "  -z: gzip the files with the given level (1: fastest, 9: best)\n");
+  fprintf(stderr, "  -T: publish packets to the given shared memory (see sniffer-tap), instead of stdout if -w is not set\n");
+  fprintf(stderr, "  -b: max delay of the stdout stream, 0 to write each packet immediately (default: %u)\n", pipe_batch.deadline_ms);
+  fprintf(stderr, "  -H: analyse DS4 input reports, and print statistics every given number of seconds\n");
+  fprintf(stderr, "  -c: correlate commands/events and ACL/completed packets, and print latencies every given number of seconds\n");
+  fprintf(stderr, "  -P: cores the line readers are pinned to (default: 1,2, modulo the number of cores)\n");
+  fprintf(stderr, "  -L: set the latency timer of the usb-serial adapters (1 gives the most accurate timestamps)\n");
+  fprintf(stderr, "  -O: subtract the given offset from the timestamps of line %d,\n", !HOST_LINE);
+  fprintf(stderr, "      or estimate it from the first %d command/event pairs (auto)\n", CALIBRATION_SAMPLES);
+  fprintf(stderr, "      (the timestamps of that line then stay at the last merged one until they catch up, to keep the capture in order)\n");
+  fprintf(stderr, "  -R: read batching: wake up the readers after vmin bytes, or vtime tenths of a second after a byte\n");
+  fprintf(stderr, "      (fewer reads, but timestamps lag behind the packets), see the reads line of the report\n");
+  fprintf(stderr, "  -l: set the low latency flag of the serial ports\n");
+  fprintf(stderr, "  -U: read with io_uring multishot reads instead of poll/read (Linux >= 6.7)\n");
+  fprintf(stderr, "  -M: capture the packets of the given controller (hciN) from the kernel monitor channel,\n");
+  fprintf(stderr, "      instead of the serial lines (e.g. a hci_vhci virtual controller, see sniffer-replay -V)\n");
+  fprintf(stderr, "  -a: reassemble L2CAP frames, and print per channel statistics\n");
+  fprintf(stderr, "  -A: same as -a, and write the frames instead of the ACL fragments\n");
+  fprintf(stderr, "  -S: publish live statistics to the given shared memory (see sniffer-stats)\n");
+  fprintf(stderr, "  -d: dump packets\n");
+  fprintf(stderr, "  filter: comma-separated list of type=cmd|acl|sco|evt|vendor|<n>, handle=<n>, cid=<n>, data=<xx:xx:...>\n");
+  fprintf(stderr, "          cid and data only match ACL start fragments, or whole frames with -A\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads command-line arguments.
+ */
+static void read_args(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, ":0:1:w:f:C:G:W:z:F:T:b:H:c:P:L:O:R:lUM:aAS:d")) != -1)
+  {
+    switch (opt)
+    {
+      case '0':
+        ports[0] = optarg;
+        break;
+      case '1':
+        ports[1] = optarg;
+        break;
+      case 'w':
+        filename = optarg;
+        break;
+      case 'f':
+        if(filter_compile(optarg) < 0)
+        {
+          usage();
+        }
+        break;
+      case 'C':
+        rotate_size = strtoull(optarg, NULL, 10) * 1000000;
+        break;
+      case 'G':
+        rotate_time = strtoul(optarg, NULL, 10);
+        break;
+      case 'W':
+        files_nb = strtoul(optarg, NULL, 10);
+        break;
+      case 'z':
+        compression.level = strtol(optarg, NULL, 10);
+        if(compression.level < 1 || compression.level > 9)
+        {
+          usage();
+        }
+        break;
+      case 'F':
+        if(sscanf(optarg, "%u:%u", &flight.pre, &flight.post) != 2)
+        {
+          usage();
+        }
+        break;
+      case 'T':
+        tap_name = optarg;
+        break;
+      case 'b':
+        pipe_batch.deadline_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'H':
+        ds4_period = strtoul(optarg, NULL, 10);
+        if(!ds4_period)
+        {
+          usage();
+        }
+        break;
+      case 'c':
+        corr.period = strtoul(optarg, NULL, 10);
+        if(!corr.period)
+        {
+          usage();
+        }
+        break;
+      case 'P':
+        if(sscanf(optarg, "%d,%d", &readers[0].cpu, &readers[1].cpu) != RX_LINES
+            || readers[0].cpu < 0 || readers[1].cpu < 0)
+        {
+          usage();
+        }
+        break;
+      case 'L':
+        latency_timer = strtol(optarg, NULL, 10);
+        if(latency_timer < 1 || latency_timer > 255)
+        {
+          usage();
+        }
+        break;
+      case 'O':
+        if(!strcmp(optarg, "auto"))
+        {
+          corr.calibrate = 1;
+        }
+        else
+        {
+          readers[!HOST_LINE].offset = strtol(optarg, NULL, 10);
+        }
+        break;
+      case 'R':
+        if(sscanf(optarg, "%d,%d", &serial_vmin, &serial_vtime) != 2
+            || serial_vmin < 0 || serial_vmin > 255 || serial_vtime < 0 || serial_vtime > 255)
+        {
+          usage();
+        }
+        break;
+      case 'l':
+        serial_low_latency = 1;
+        break;
+      case 'U':
+        use_uring = 1;
+        break;
+      case 'M':
+        monitor_index = strtol(optarg, NULL, 10);
+        if(monitor_index < 0 || monitor_index >= HCI_DEV_NONE)
+        {
+          usage();
+        }
+        break;
+      case 'A':
+        l2cap.write = 1;
+        // fall through
+      case 'a':
+        l2cap.enabled = 1;
+        break;
+      case 'S':
+        stats_name = optarg;
+        break;
+      case 'd':
+        debug = 1;
+        break;
+      default: /* '?' */
+        usage();
+        break;
+    }
+  }
+
+  if((flight.pre || flight.post) && !filename)
+  {
+    usage();
+  }
+}
+
+static volatile int done = 0;
+
+void terminate(int sig)
+{
+  done = 1;
+}
+
+
+unsigned char buf[RX_LINES][BUFFER_SIZE] = {};
+unsigned int direction[RX_LINES] = {};
+int last[RX_LINES] = {};
+struct timeval tv[RX_LINES] = {};
+
+
+/*
+ * Returns the length of the packet starting at data,
+ * 0 if more data is needed to get it, or -1 if the header is not valid.
+ */
+static int packet_length(const unsigned char* data, unsigned int available)
+{
+  int length = -1;
+
+  switch(data[0])
+  {
+    case HCI_COMMAND_PKT:
+    case HCI_SCODATA_PKT:
+      length = available > 3 ? data[3]+4 : 0;
+      break;
+    case HCI_ACLDATA_PKT:
+      length = available > 4 ? data[3]+(data[4] << 8)+5 : 0;
+      if(length > BUFFER_SIZE)
+      {
+        length = -1;
+      }
+      break;
+    case HCI_EVENT_PKT:
+    case HCI_VENDOR_PKT:
+      length = available > 2 ? data[2]+3 : 0;
+      break;
+  }
+
+  return length;
+}
+
+/*
+ * Number of consecutive packets that have to look valid for a resync to succeed.
+ */
+#define RESYNC_DEPTH 3
+
+/*
+ * Tells if a packet may start at data.
+ * The header has to be valid, the L2CAP length of a start fragment has to match the ACL length,
+ * and the packet has to be followed by a zero filler, or by another candidate.
+ * Returns 1 if it's the case, 0 if it's not, or -1 if more data is needed to tell.
+ */
+static int resync_candidate(const unsigned char* data, unsigned int available, int depth)
+{
+  int length = packet_length(data, available);
+
+  if(length < 0)
+  {
+    return 0;
+  }
+
+  if(length == 0)
+  {
+    return -1;
+  }
+
+  if(data[0] == HCI_ACLDATA_PKT && ((data[2] >> 4) & 0x03) != 0x01)
+  {
+    if(available < 7)
+    {
+      return -1;
+    }
+    if(data[5]+(data[6] << 8)+4 != data[3]+(data[4] << 8))
+    {
+      return 0;
+    }
+  }
+
+  if(length > available)
+  {
+    return -1;
+  }
+
+  if(length == available)
+  {
+    // at least one complete packet before the end of the data
+    return depth < RESYNC_DEPTH ? 1 : -1;
+  }
+
+  if(!data[length])
+  {
+    return 1;
+  }
+
+  if(depth == 1)
+  {
+    return packet_length(data+length, available-length) >= 0;
+  }
+
+  return resync_candidate(data+length, available-length, depth-1);
+}
+
+static int syncing[RX_LINES] = {};
+static unsigned int lost[RX_LINES] = {};
+
+static void consume(int index, unsigned int length)
+{
+  memmove(buf[index], buf[index]+length, last[index]-length);
+
+  last[index] -= length;
+}
+
+static uint64_t timeval_us(const struct timeval* t)
+{
+  return t->tv_sec * 1000000ULL + t->tv_usec;
+}
+
+/*
+ * Queues a packet for the merge, or drops it if the queue is full.
+ */
+static void queue_push(s_reader* reader, struct timeval* t, unsigned int length, const unsigned char* data)
+{
+  unsigned int size = TAP_ALIGN(sizeof(s_line_record) + length);
+  unsigned int head = reader->head;
+  unsigned int offset = head % LINE_QUEUE_SIZE;
+  unsigned int padding = offset + size > LINE_QUEUE_SIZE ? LINE_QUEUE_SIZE - offset : 0;
+  unsigned int tail = __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE);
+
+  if(head - tail + padding + size > LINE_QUEUE_SIZE)
+  {
+    STATS_ADD(stats->lines[reader - readers].overflows, 1);
+    return;
+  }
+
+  if(padding)
+  {
+    ((s_line_record*)(reader->queue + offset))->length = LINE_QUEUE_PADDING;
+    head += padding;
+    offset = 0;
+  }
+
+  s_line_record* record = (s_line_record*)(reader->queue + offset);
+  record->length = length;
+  record->arrival = __atomic_fetch_add(&merge.arrivals, 1, __ATOMIC_RELAXED);
+  record->resyncs = reader->resyncs;
+  record->tv = *t;
+  memcpy(record + 1, data, length);
+
+  reader->resyncs = 0;
+
+  stats_packet(reader - readers, length, data);
+
+  __atomic_store_n(&reader->head, head + size, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the oldest packet of a queue, or NULL if it is empty.
+ */
+static s_line_record* queue_peek(s_reader* reader)
+{
+  unsigned int head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+  unsigned int tail = reader->tail;
+
+  if(tail == head)
+  {
+    return NULL;
+  }
+
+  s_line_record* record = (s_line_record*)(reader->queue + tail % LINE_QUEUE_SIZE);
+  if(record->length == LINE_QUEUE_PADDING)
+  {
+    tail += LINE_QUEUE_SIZE - tail % LINE_QUEUE_SIZE;
+    __atomic_store_n(&reader->tail, tail, __ATOMIC_RELEASE);
+    if(tail == head)
+    {
+      return NULL;
+    }
+    record = (s_line_record*)reader->queue;
+  }
+
+  return record;
+}
+
+static void queue_pop(s_reader* reader, s_line_record* record)
+{
+  __atomic_store_n(&reader->tail, reader->tail + TAP_ALIGN(sizeof(*record) + record->length), __ATOMIC_RELEASE);
+}
+
+/*
+ * Counts the packets of a queue that were queued before the given arrival.
+ */
+static unsigned int queue_count_before(s_reader* reader, unsigned int arrival)
+{
+  unsigned int head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+  unsigned int position = reader->tail;
+  unsigned int count = 0;
+
+  while(position != head)
+  {
+    s_line_record* record = (s_line_record*)(reader->queue + position % LINE_QUEUE_SIZE);
+    if(record->length == LINE_QUEUE_PADDING)
+    {
+      position += LINE_QUEUE_SIZE - position % LINE_QUEUE_SIZE;
+      continue;
+    }
+    if((int)(record->arrival - arrival) >= 0)
+    {
+      break;
+    }
+    ++count;
+    position += TAP_ALIGN(sizeof(*record) + record->length);
+  }
+
+  return count;
+}
+
+/*
+ * Frames the next packet of a line and queues it.
+ * Returns 1 if there may be another one in the buffer.
+ */
+int read_packet(int index)
+{
+  unsigned char* data = buf[index];
+  int offset = 0;
+
+  while(offset < last[index] && !data[offset])
+  {
+    offset++;
+  }
+
+  if(offset)
+  {
+    if(filename)
+    {
+      log_printf("(%d) skip: %d byte(s)\n", index, offset);
+    }
+    STATS_ADD(stats->lines[index].skipped, offset);
+    consume(index, offset);
+  }
+
+  if(!last[index])
+  {
+    return 0;
+  }
+
+  unsigned char type = data[0];
+
+  int length = packet_length(data, last[index]);
+
+  if(length < 0 && !syncing[index])
+  {
+    if(filename)
+    {
+      log_printf("(%d) sync lost: packet type=0x%02x\n", index, type);
+    }
+    syncing[index] = 1;
+    STATS_ADD(stats->lines[index].resyncs, 1);
+    ++readers[index].resyncs;
+  }
+
+  if(syncing[index])
+  {
+    /*
+     * Drop bytes until something that looks like a packet shows up.
+     */
+    int res = 0;
+    offset = 0;
+    while(offset < last[index] && !(res = resync_candidate(data+offset, last[index]-offset, RESYNC_DEPTH)))
+    {
+      offset++;
+    }
+
+    STATS_ADD(stats->lines[index].lost, offset);
+    lost[index] += offset;
+    consume(index, offset);
+
+    if(res < 0 && last[index] < BUFFER_SIZE)
+    {
+      // wait for more data
+      return 0;
+    }
+
+    if(res == 0)
+    {
+      return 0;
+    }
+
+    if(filename)
+    {
+      log_printf("(%d) resync: %u byte(s) lost\n", index, lost[index]);
+    }
+    syncing[index] = 0;
+    lost[index] = 0;
+
+    length = packet_length(data, last[index]);
+  }
+
+  if(!length || last[index] < length)
+  {
+    return 0;
+  }
+
+  queue_push(readers + index, tv + index, length, data);
+
+  /*
+   * The bytes read after the end of the packet delayed its timestamp
+   * by at least their transfer time.
+   */
+  unsigned long long lag = (last[index] - length) * TTY_BYTE_TIME;
+  readers[index].lag += lag;
+  if(lag / 1000 > readers[index].max_lag)
+  {
+    readers[index].max_lag = lag / 1000;
+  }
+  ++readers[index].packets;
+
+  consume(index, length);
+
+  return 1;
+}
+
+static void packet_write(int index, struct timeval* t, unsigned int length, unsigned char* data)
+{
+  if(filter_match(length, data))
+  {
+    pcapwriter_write(t, direction[index], length, data);
+  }
+  else
+  {
+    ++filtered;
+  }
+}
+
+/*
+ * Analyses and writes a merged packet.
+ */
+static void process_packet(int index, s_line_record* record)
+{
+  unsigned char* data = (unsigned char*)(record + 1);
+  unsigned int length = record->length;
+  unsigned char type = data[0];
+
+  if(record->resyncs)
+  {
+    flight_trigger("resync", &record->tv);
+  }
+
+  switch(type)
+  {
+    case HCI_COMMAND_PKT:
+      direction[index] = 0x00000000;
+      break;
+    case HCI_EVENT_PKT:
+      direction[index] = 0x01000000;
+      break;
+  }
+
+  if(filename)
+  {
+    log_printf("(%d) packet: type=0x%02x length=%d\n", index, type, length);
+  }
+
+  if(debug)
+  {
+    int j;
+    for(j=0; j<length; j+=8)
+    {
+      int k;
+      char row[8*5+1];
+      for(k=0; k<8 && j+k<length; ++k)
+      {
+        sprintf(row+5*k, "0x%02x ", data[j+k]);
+      }
+      log_printf("%s\n", row);
+    }
+  }
+
+  if(type == HCI_EVENT_PKT && data[1] == HCI_EV_DISCONN_COMPLETE)
+  {
+    flight_trigger("disconnection", &record->tv);
+  }
+
+  ds4_analyse(&record->tv, length, data);
+
+  corr_analyse(index, &record->tv, length, data);
+
+  if(l2cap.enabled && type == HCI_ACLDATA_PKT && length >= ACL_HEADER_SIZE)
+  {
+    unsigned char* frame;
+    unsigned int frame_length;
+    int complete = l2cap_reassemble(index, &record->tv, length, data, &frame, &frame_length);
+    if(l2cap.write)
+    {
+      if(complete)
+      {
+        packet_write(index, &record->tv, frame_length, frame);
+      }
+      return;
+    }
+  }
+
+  packet_write(index, &record->tv, length, data);
+}
+
+/*
+ * Processes the queued packets in timestamp order.
+ * A packet is held as long as another line may still queue an older one.
+ */
+static void merge_packets()
+{
+  while(1)
+  {
+    uint64_t watermarks[RX_LINES];
+    s_line_record* records[RX_LINES];
+    int best = -1;
+    int i;
+
+    // load the watermarks first: packets queued after that are not older
+    for(i=0; i<RX_LINES; ++i)
+    {
+      watermarks[i] = __atomic_load_n(&readers[i].watermark, __ATOMIC_ACQUIRE);
+    }
+
+    for(i=0; i<RX_LINES; ++i)
+    {
+      records[i] = queue_peek(readers + i);
+      if(records[i] && (best < 0 || timeval_us(&records[i]->tv) < timeval_us(&records[best]->tv)))
+      {
+        best = i;
+      }
+    }
+
+    if(best < 0)
+    {
+      __atomic_store_n(&merge.held, 0, __ATOMIC_RELAXED);
+      return;
+    }
+
+    uint64_t ts = timeval_us(&records[best]->tv);
+
+    for(i=0; i<RX_LINES; ++i)
+    {
+      if(!records[i] && watermarks[i] < ts)
+      {
+        __atomic_store_n(&merge.held, 1, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+
+    unsigned int depth = 0;
+    for(i=0; i<RX_LINES; ++i)
+    {
+      if(i != best)
+      {
+        depth += queue_count_before(readers + i, records[best]->arrival);
+      }
+    }
+    if(depth)
+    {
+      ++merge.reordered;
+      if(depth > merge.max_depth)
+      {
+        merge.max_depth = depth;
+      }
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t hold = timeval_us(&now) - ts;
+    if(hold > merge.max_hold && hold < UINT_MAX)
+    {
+      merge.max_hold = hold;
+    }
+
+    process_packet(best, records[best]);
+
+    queue_pop(readers + best, records[best]);
+
+    ++merge.packets;
+  }
+}
+
+static void merge_signal()
+{
+  uint64_t value = 1;
+  if(write(merge.event, &value, sizeof(value)) < 0)
+  {
+    // the counter is already set
+  }
+}
+
+/*
+ * Publishes the watermark of a reader, once everything it read is queued.
+ * Returns the offset to apply to the next timestamps.
+ * The watermark never goes back, even when -O auto raises the offset:
+ * the merge may already have written packets of the other line up to it.
+ */
+static int reader_watermark(s_reader* reader)
+{
+  int offset = __atomic_load_n(&reader->offset, __ATOMIC_RELAXED);
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint64_t watermark = timeval_us(&now) - offset;
+  if(watermark > reader->watermark)
+  {
+    __atomic_store_n(&reader->watermark, watermark, __ATOMIC_RELEASE);
+  }
+
+  return offset;
+}
+
+static void reader_error(const char* message, int fd)
+{
+  fprintf(stderr, "%s fd=%d\n", message, fd);
+  done = 1;
+  merge_signal();
+}
+
+/*
+ * Timestamps and frames the bytes just read into the buffer of a line.
+ */
+static void reader_input(int index, int offset, struct timeval* wake, int res)
+{
+  s_reader* reader = readers + index;
+
+  gettimeofday(tv+index, NULL);
+
+  ++reader->reads;
+  reader->bytes += res;
+  STATS_ADD(stats->lines[index].bytes, res);
+  reader->last_read = timeval_us(tv+index);
+  if(!reader->first_read)
+  {
+    reader->first_read = reader->last_read;
+  }
+  uint64_t delay = timeval_us(tv+index) - timeval_us(wake);
+
+  if(offset)
+  {
+    // corrected timestamp, not older than the published watermark (see reader_watermark)
+    uint64_t ts = timeval_us(tv+index) - offset;
+    if(ts < reader->watermark)
+    {
+      ts = reader->watermark;
+    }
+    tv[index].tv_sec = ts / 1000000;
+    tv[index].tv_usec = ts % 1000000;
+  }
+  if(delay > reader->max_read_delay && delay < UINT_MAX)
+  {
+    reader->max_read_delay = delay;
+  }
+
+  if(filename)
+  {
+    log_printf("(%d) read: %d bytes\n", index, res);
+  }
+
+  last[index] += res;
+
+  unsigned int head = reader->head;
+
+  while(read_packet(index)) {}
+
+  if(reader->head != head)
+  {
+    merge_signal();
+  }
+}
+
+/*
+ * Alternative reader backend (-U): a multishot read per line, on a ring owned by its reader.
+ * The kernel picks the destination in a ring of provided buffers, completions are harvested in batches,
+ * and the buffers are handed back to the kernel by moving the ring tail.
+ * Syscalls are made directly, liburing is not needed.
+ */
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT 49 /* Linux 6.7 */
+#endif
+
+#define URING_ENTRIES 8
+#define URING_BUFFERS 64 /* power of 2 */
+#define URING_BUFFER_SIZE 4096
+#define URING_GROUP 0
+
+typedef struct
+{
+  int fd;
+  void* ring;
+  size_t ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned int* sq_tail;
+  unsigned int* sq_array;
+  unsigned int sq_mask;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe* cqes;
+  struct io_uring_buf_ring* buffers_ring;
+  size_t buffers_ring_size;
+  unsigned char* buffers;
+  unsigned short buffers_tail;
+} s_uring;
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags, void* arg, size_t size)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static void uring_close(s_uring* uring)
+{
+  if(uring->buffers)
+  {
+    munmap(uring->buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+  }
+  if(uring->buffers_ring)
+  {
+    munmap(uring->buffers_ring, uring->buffers_ring_size);
+  }
+  if(uring->sqes)
+  {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if(uring->ring)
+  {
+    munmap(uring->ring, uring->ring_size);
+  }
+  if(uring->fd >= 0)
+  {
+    close(uring->fd);
+  }
+}
+
+static void uring_buffer_add(s_uring* uring, unsigned short bid)
+{
+  struct io_uring_buf* buffer = uring->buffers_ring->bufs + (uring->buffers_tail & (URING_BUFFERS - 1));
+  buffer->addr = (uintptr_t)(uring->buffers + bid * URING_BUFFER_SIZE);
+  buffer->len = URING_BUFFER_SIZE;
+  buffer->bid = bid;
+  ++uring->buffers_tail;
+}
+
+static int uring_init(s_uring* uring)
+{
+  struct io_uring_params params = { .flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN };
+
+  memset(uring, 0x00, sizeof(*uring));
+
+  uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if(uring->fd < 0 && errno == EINVAL)
+  {
+    // older kernel
+    memset(&params, 0x00, sizeof(params));
+    uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  }
+  if(uring->fd < 0)
+  {
+    fprintf(stderr, "can't create io_uring: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+  {
+    fprintf(stderr, "io_uring is too old\n");
+    uring_close(uring);
+    return -1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if(uring->ring == MAP_FAILED || uring->sqes == MAP_FAILED)
+  {
+    fprintf(stderr, "can't map io_uring: %s\n", strerror(errno));
+    uring->ring = uring->ring == MAP_FAILED ? NULL : uring->ring;
+    uring->sqes = uring->sqes == MAP_FAILED ? NULL : uring->sqes;
+    uring_close(uring);
+    return -1;
+  }
+
+  unsigned char* ring = uring->ring;
+  uring->sq_tail = (unsigned int*)(ring + params.sq_off.tail);
+  uring->sq_array = (unsigned int*)(ring + params.sq_off.array);
+  uring->sq_mask = *(unsigned int*)(ring + params.sq_off.ring_mask);
+  uring->cq_head = (unsigned int*)(ring + params.cq_off.head);
+  uring->cq_tail = (unsigned int*)(ring + params.cq_off.tail);
+  uring->cq_mask = *(unsigned int*)(ring + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+  /*
+   * The provided buffers, and the ring that hands them to the kernel.
+   */
+  uring->buffers_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  uring->buffers_ring = mmap(NULL, uring->buffers_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  uring->buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if(uring->buffers_ring == MAP_FAILED || uring->buffers == MAP_FAILED)
+  {
+    fprintf(stderr, "can't allocate io_uring buffers\n");
+    uring->buffers_ring = uring->buffers_ring == MAP_FAILED ? NULL : uring->buffers_ring;
+    uring->buffers = uring->buffers == MAP_FAILED ? NULL : uring->buffers;
+    uring_close(uring);
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg =
+  {
+    .ring_addr = (uintptr_t)uring->buffers_ring,
+    .ring_entries = URING_BUFFERS,
+    .bgid = URING_GROUP,
+  };
+  if(syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    fprintf(stderr, "can't register io_uring buffers: %s\n", strerror(errno));
+    uring_close(uring);
+    return -1;
+  }
+
+  unsigned short i;
+  for(i=0; i<URING_BUFFERS; ++i)
+  {
+    uring_buffer_add(uring, i);
+  }
+  __atomic_store_n(&uring->buffers_ring->tail, uring->buffers_tail, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/*
+ * Queues a multishot read, it keeps completing until an error or a lack of buffers.
+ */
+static void uring_read(s_uring* uring, int fd)
+{
+  unsigned int tail = *uring->sq_tail;
+  unsigned int index = tail & uring->sq_mask;
+  struct io_uring_sqe* sqe = uring->sqes + index;
+
+  memset(sqe, 0x00, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ_MULTISHOT;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_GROUP;
+  sqe->user_data = fd;
+
+  uring->sq_array[index] = index;
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void reader_uring(int index)
+{
+  s_reader* reader = readers + index;
+  s_uring uring;
+
+  if(uring_init(&uring) < 0)
+  {
+    reader_error("can't read with io_uring from", reader->fd);
+    return;
+  }
+
+  unsigned int submit = 1;
+  uring_read(&uring, reader->fd);
+
+  struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = READER_IDLE_PERIOD * 1000000 };
+  struct io_uring_getevents_arg arg = { .ts = (uintptr_t)&timeout };
+
+  while(!done)
+  {
+    int offset = reader_watermark(reader);
+
+    int res = uring_enter(uring.fd, submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if(res < 0 && errno != ETIME && errno != EINTR)
+    {
+      reader_error("io_uring error on", reader->fd);
+      break;
+    }
+    if(res >= 0)
+    {
+      submit = 0;
+    }
+
+    struct timeval wake;
+    gettimeofday(&wake, NULL);
+
+    unsigned int head = *uring.cq_head;
+    unsigned int tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+    if(head == tail)
+    {
+      if(__atomic_load_n(&merge.held, __ATOMIC_RELAXED))
+      {
+        // the watermark moved, the held packet may be released
+        merge_signal();
+      }
+      continue;
+    }
+
+    for(; head != tail; ++head)
+    {
+      struct io_uring_cqe* cqe = uring.cqes + (head & uring.cq_mask);
+
+      if(cqe->res == -ENOBUFS)
+      {
+        // the buffers of this batch are given back below, then the read is queued again
+        ++reader->uring_rearms;
+      }
+      else if(cqe->res < 0)
+      {
+        errno = -cqe->res;
+        reader_error(errno == EINVAL ? "multishot read not supported on" : "error reading from", reader->fd);
+        break;
+      }
+      else if(cqe->flags & IORING_CQE_F_BUFFER)
+      {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        unsigned char* data = uring.buffers + bid * URING_BUFFER_SIZE;
+        unsigned int length = cqe->res;
+
+        while(length)
+        {
+          unsigned int size = sizeof(*buf) - last[index];
+          if(size > length)
+          {
+            size = length;
+          }
+          memcpy(buf[index] + last[index], data, size);
+          reader_input(index, offset, &wake, size);
+          data += size;
+          length -= size;
+        }
+
+        uring_buffer_add(&uring, bid);
+      }
+
+      if(!(cqe->flags & IORING_CQE_F_MORE))
+      {
+        uring_read(&uring, reader->fd);
+        ++submit;
+      }
+    }
+
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&uring.buffers_ring->tail, uring.buffers_tail, __ATOMIC_RELEASE);
+  }
+
+  uring_close(&uring);
+}
+
+static void* reader_thread(void* arg)
+{
+  int index = (intptr_t)arg;
+  s_reader* reader = readers + index;
+  struct pollfd pfd = { .fd = reader->fd, .events = POLLIN };
+
+  log_current = log_ring.rings + 1 + index;
+
+  if(use_uring)
+  {
+    reader_uring(index);
+    return NULL;
+  }
+
+  while(!done)
+  {
+    int offset = reader_watermark(reader);
+
+    int res = poll(&pfd, 1, READER_IDLE_PERIOD);
+    if(res <= 0)
+    {
+      if(res < 0 && errno != EINTR)
+      {
+        reader_error("error polling", pfd.fd);
+      }
+      else if(__atomic_load_n(&merge.held, __ATOMIC_RELAXED))
+      {
+        // the watermark moved, the held packet may be released
+        merge_signal();
+      }
+      continue;
+    }
+
+    if(pfd.revents & POLLERR)
+    {
+      reader_error("error reading from", pfd.fd);
+      break;
+    }
+
+    struct timeval wake;
+    gettimeofday(&wake, NULL);
+
+    res = read(pfd.fd, buf[index]+last[index], sizeof(*buf)-last[index]);
+    if(res < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      reader_error("error reading from", pfd.fd);
+      break;
+    }
+
+    if(res > 0)
+    {
+      reader_input(index, offset, &wake, res);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Alternative capture source (-M): the Bluetooth monitor channel of the kernel,
+ * when the controller is attached to the capture host.
+ * Packets come already framed, with the direction given by the opcode of the monitor header,
+ * and timestamped by the kernel (SO_TIMESTAMP). They are queued as if they had been read on the lines.
+ */
+#define HCI_MON_COMMAND_PKT 2
+#define HCI_MON_EVENT_PKT 3
+#define HCI_MON_ACL_TX_PKT 4
+#define HCI_MON_ACL_RX_PKT 5
+#define HCI_MON_SCO_TX_PKT 6
+#define HCI_MON_SCO_RX_PKT 7
+#define HCI_MON_ISO_TX_PKT 18
+#define HCI_MON_ISO_RX_PKT 19
+
+struct sockaddr_hci
+{
+  sa_family_t hci_family;
+  unsigned short hci_dev;
+  unsigned short hci_channel;
+};
+
+typedef struct
+{
+  uint16_t opcode;
+  uint16_t index;
+  uint16_t length;
+} s_monitor_header;
+
+static struct
+{
+  int fd;
+  unsigned long long packets;
+  unsigned long long delay; /* sum of the delays between the kernel timestamps and the reception, in us */
+  unsigned int max_delay;
+} monitor = { .fd = -1 };
+
+static int monitor_open()
+{
+  struct sockaddr_hci addr =
+  {
+    .hci_family = AF_BLUETOOTH,
+    .hci_dev = HCI_DEV_NONE,
+    .hci_channel = HCI_CHANNEL_MONITOR,
+  };
+  int on = 1;
+
+  monitor.fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+  if(monitor.fd < 0)
+  {
+    fprintf(stderr, "can't open the HCI monitor socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if(bind(monitor.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || setsockopt(monitor.fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) < 0)
+  {
+    fprintf(stderr, "can't bind the HCI monitor socket: %s\n", strerror(errno));
+    close(monitor.fd);
+    monitor.fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Gives the H4 type and the line of a monitor opcode.
+ * Returns -1 for the opcodes that don't carry HCI packets.
+ */
+static int monitor_type(uint16_t opcode, unsigned char* type)
+{
+  switch(opcode)
+  {
+    case HCI_MON_COMMAND_PKT:
+      *type = HCI_COMMAND_PKT;
+      return HOST_LINE;
+    case HCI_MON_EVENT_PKT:
+      *type = HCI_EVENT_PKT;
+      return !HOST_LINE;
+    case HCI_MON_ACL_TX_PKT:
+      *type = HCI_ACLDATA_PKT;
+      return HOST_LINE;
+    case HCI_MON_ACL_RX_PKT:
+      *type = HCI_ACLDATA_PKT;
+      return !HOST_LINE;
+    case HCI_MON_SCO_TX_PKT:
+      *type = HCI_SCODATA_PKT;
+      return HOST_LINE;
+    case HCI_MON_SCO_RX_PKT:
+      *type = HCI_SCODATA_PKT;
+      return !HOST_LINE;
+    case HCI_MON_ISO_TX_PKT:
+      *type = HCI_ISODATA_PKT;
+      return HOST_LINE;
+    case HCI_MON_ISO_RX_PKT:
+      *type = HCI_ISODATA_PKT;
+      return !HOST_LINE;
+  }
+  return -1;
+}
+
+static void* monitor_thread(void* arg)
+{
+  struct pollfd pfd = { .fd = monitor.fd, .events = POLLIN };
+  unsigned char packet[BUFFER_SIZE];
+  s_monitor_header header;
+  union
+  {
+    struct cmsghdr align;
+    char data[CMSG_SPACE(sizeof(struct timeval))];
+  } control;
+  struct iovec iov[2] =
+  {
+    { .iov_base = &header, .iov_len = sizeof(header) },
+    { .iov_base = packet + 1, .iov_len = sizeof(packet) - 1 },
+  };
+  int i;
+
+  log_current = log_ring.rings + 1;
+
+  while(!done)
+  {
+    int res = poll(&pfd, 1, READER_IDLE_PERIOD);
+    if(res < 0 && errno != EINTR)
+    {
+      reader_error("error polling", monitor.fd);
+      break;
+    }
+    if(res <= 0)
+    {
+      continue;
+    }
+
+    unsigned int queued = 0;
+
+    while(1)
+    {
+      struct msghdr msg =
+      {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = &control,
+        .msg_controllen = sizeof(control),
+      };
+
+      ssize_t length = recvmsg(monitor.fd, &msg, MSG_DONTWAIT);
+      if(length < 0)
       {
-        if(pfd[i].revents & POLLIN)
+        if(errno != EAGAIN && errno != EINTR)
         {
-          res = read(pfd[i].fd, buf[i]+last[i], sizeof(*buf)-last[i]);
-          if(res < 0)
-          {
-            if(errno == EINTR)
-            {
-              continue;
-            }
-            else
-            {
-              fprintf(stderr, "error reading from fd=%d\n", pfd[i].fd);
-              done = 1;
-            }
-          }
-          else if(res > 0)
-          {
-            if(filename)
-            {
-              printf("(%d) read: %d bytes\n", i, res);
-            }
+          reader_error("error reading from", monitor.fd);
+        }
+        break;
+      }
 
-            last[i] += res;
+      struct timeval now;
+      gettimeofday(&now, NULL);
 
-            gettimeofday(tv+i, NULL);
+      if(length < (ssize_t)sizeof(header) || header.length > length - sizeof(header))
+      {
+        continue;
+      }
 
-            while(read_packet(i)) {}
-          }
+      int index = monitor_type(header.opcode, packet);
+      if(index < 0 || (monitor_index >= 0 && header.index != monitor_index))
+      {
+        continue;
+      }
+
+      struct timeval ts = now;
+      struct cmsghdr* cmsg;
+      for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP)
+        {
+          memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
         }
-        if(pfd[i].revents & POLLERR)
+      }
+
+      uint64_t delay = timeval_us(&now) - timeval_us(&ts);
+      if(delay < UINT_MAX)
+      {
+        monitor.delay += delay;
+        if(delay > monitor.max_delay)
         {
-          fprintf(stderr, "error reading from fd=%d\n", pfd[i].fd);
-          done = 1;
+          monitor.max_delay = delay;
         }
       }
+      ++monitor.packets;
+
+      s_reader* reader = readers + index;
+      ++reader->reads;
+      reader->bytes += 1 + header.length;
+      STATS_ADD(stats->lines[index].bytes, 1 + header.length);
+
+      queue_push(reader, &ts, 1 + header.length, packet);
+      ++queued;
+
+      /*
+       * The kernel delivers the packets of both directions in order:
+       * nothing older than this one will be queued on any line.
+       */
+      for(i=0; i<RX_LINES; ++i)
+      {
+        __atomic_store_n(&readers[i].watermark, timeval_us(&ts), __ATOMIC_RELEASE);
+      }
+    }
+
+    if(queued)
+    {
+      merge_signal();
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Start a real-time reader pinned to its core.
+ */
+static int reader_start(int index, void* (*routine)(void*))
+{
+  s_reader* reader = readers + index;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(reader->cpu < 0)
+  {
+    reader->cpu = (index + 1) % (cores > 0 ? cores : 1);
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(reader->cpu, &set);
+
+  pthread_attr_t attr;
+  struct sched_param p = { .sched_priority = sched_get_priority_max(SCHED_FIFO) };
+  pthread_attr_init(&attr);
+  pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &p);
+
+  int ret = start_thread(&reader->thread, &attr, routine, (void*)(intptr_t)index);
+  if(ret < 0)
+  {
+    // not allowed to use a real-time policy
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    ret = start_thread(&reader->thread, &attr, routine, (void*)(intptr_t)index);
+  }
+
+  pthread_attr_destroy(&attr);
+
+  reader->started = !ret;
+
+  return ret;
+}
+
+static void print_stats()
+{
+  FILE* out = filename ? stdout : stderr;
+  int i;
+
+  if(filters_nb)
+  {
+    fprintf(out, "filter: %u packet(s) dropped\n", filtered);
+  }
+
+  if(pipe_batch.writes)
+  {
+    fprintf(out, "pipe: %llu packet(s), %llu write(s)\n", pipe_batch.records, pipe_batch.writes);
+  }
+
+  unsigned int dropped = 0;
+  for(i=0; i<LOG_PRODUCERS; ++i)
+  {
+    dropped += log_ring.rings[i].dropped;
+  }
+  if(dropped)
+  {
+    fprintf(out, "log: %u message(s) dropped\n", dropped);
+  }
+
+  if(compression.raw_total)
+  {
+    double cpu = compression.cpu.tv_sec + compression.cpu.tv_nsec / 1e9;
+    fprintf(out, "compression: %llu -> %llu byte(s), ratio %.2f, %.3fs cpu (%.1f MB/s), %u chunk(s) stored\n",
+        compression.raw_total, compression.compressed_total, (double)compression.raw_total / compression.compressed_total,
+        cpu, cpu > 0 ? compression.raw_total / cpu / 1e6 : 0, compression.stored_chunks);
+  }
+
+  if(flight.dumps || flight.ignored)
+  {
+    fprintf(out, "flight recorder: %u dump(s), %u trigger(s) ignored\n", flight.dumps, flight.ignored);
+  }
+
+  if(writer.dropped)
+  {
+    fprintf(out, "writer: %u packet(s) dropped, the disk could not keep up\n", writer.dropped);
+  }
+
+  if(writer.discarded)
+  {
+    fprintf(out, "writer: %u chunk(s) discarded, the capture file could not be opened\n", writer.discarded);
+  }
+
+  for(i=0; i<RX_LINES; ++i)
+  {
+    if(stats->lines[i].resyncs)
+    {
+      fprintf(out, "(%d) resync: %llu event(s), %llu byte(s) lost\n", i,
+          (unsigned long long)stats->lines[i].resyncs, (unsigned long long)stats->lines[i].lost);
+    }
+    if(readers[i].started)
+    {
+      fprintf(out, "(%d) reader: cpu %d, %llu read(s), worst read delay %u us, offset %d us\n",
+          i, readers[i].cpu, readers[i].reads, readers[i].max_read_delay, readers[i].offset);
+    }
+    if(readers[i].reads && monitor.fd < 0)
+    {
+      double duration = (readers[i].last_read - readers[i].first_read) / 1e6;
+      fprintf(out, "(%d) reads: %.0f/s, %.1f byte(s)/read, timestamp lag >= %.1f us mean, %u us max\n",
+          i, duration > 0 ? readers[i].reads / duration : 0, (double)readers[i].bytes / readers[i].reads,
+          readers[i].packets ? readers[i].lag / 1e3 / readers[i].packets : 0, readers[i].max_lag);
+    }
+    if(readers[i].latency_timer >= 0)
+    {
+      fprintf(out, "(%d) latency timer: %d ms\n", i, readers[i].latency_timer);
+    }
+    if(readers[i].uring_rearms)
+    {
+      fprintf(out, "(%d) reader: %u multishot read(s) restarted, out of buffers\n", i, readers[i].uring_rearms);
+    }
+    if(stats->lines[i].overflows)
+    {
+      fprintf(out, "(%d) reader: %llu packet(s) dropped, queue full\n", i, (unsigned long long)stats->lines[i].overflows);
+    }
+  }
+
+  if(monitor.packets)
+  {
+    fprintf(out, "monitor: %llu packet(s), kernel timestamp to reception: mean %.1f us, max %u us\n",
+        monitor.packets, (double)monitor.delay / monitor.packets, monitor.max_delay);
+  }
+
+  fprintf(out, "merge: %llu packet(s), %llu reordered, max depth %u, worst hold %u us\n",
+      merge.packets, merge.reordered, merge.max_depth, merge.max_hold);
+
+  /*
+   * To compare the cost of the capture sources.
+   */
+  struct rusage usage;
+  unsigned long long bytes = 0;
+  for(i=0; i<RX_LINES; ++i)
+  {
+    bytes += readers[i].bytes;
+  }
+  if(!getrusage(RUSAGE_SELF, &usage) && bytes)
+  {
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    fprintf(out, "cpu: %.3fs, %.3fs/MB\n", cpu, cpu / (bytes / 1e6));
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  (void) signal(SIGINT, terminate);
+
+  /*
+   * The readers use the highest priority, the merge comes right after.
+   */
+  struct sched_param p =
+  {
+      .sched_priority = sched_get_priority_max(SCHED_FIFO) - 1
+  };
+
+  sched_setscheduler(0, SCHED_FIFO, &p);
+
+  read_args(argc, argv);
+
+  int i;
+
+  if(monitor_index >= 0)
+  {
+    if(monitor_open() < 0)
+    {
+      exit(-1);
+    }
+  }
+  else
+  {
+    for(i=0; i<RX_LINES; ++i)
+    {
+      readers[i].fd = serial_connect(ports[i]);
+      if(readers[i].fd < 0)
+      {
+        exit(-1);
+      }
+      latency_timer_setup(i);
+    }
+  }
+
+  merge.event = eventfd(0, EFD_NONBLOCK);
+  if(merge.event < 0)
+  {
+    fprintf(stderr, "can't create eventfd: %s\n", strerror(errno));
+    exit(-1);
+  }
+
+  log_init();
+
+  stats_init();
+  stats->writer_chunks = CHUNKS_NB;
+
+  tap_init();
+
+  flight_init();
+
+  (void) signal(SIGUSR1, flight_signal);
+
+  pcapwriter_init(argv[1]);
+
+  l2cap_init();
+
+  if(monitor.fd >= 0)
+  {
+    if(reader_start(0, monitor_thread) < 0)
+    {
+      fprintf(stderr, "can't create monitor thread\n");
+      done = 1;
+    }
+  }
+  else
+  {
+    for(i=0; i<RX_LINES; ++i)
+    {
+      if(reader_start(i, reader_thread) < 0)
+      {
+        fprintf(stderr, "can't create reader thread\n");
+        done = 1;
+      }
+    }
+  }
+
+  struct pollfd pfd = { .fd = merge.event, .events = POLLIN };
+
+  while(!done)
+  {
+    int timeout = pipe_timeout();
+    int flight_ms = flight_timeout();
+    if(flight_ms >= 0 && (timeout < 0 || flight_ms < timeout))
+    {
+      timeout = flight_ms;
+    }
+
+    if(poll(&pfd, 1, timeout) > 0)
+    {
+      uint64_t value;
+      if(read(merge.event, &value, sizeof(value)) < 0)
+      {
+        // spurious wakeup
+      }
     }
+
+    merge_packets();
+
+    STATS_SET(stats->merged, merge.packets);
+    STATS_SET(stats->filtered, filtered);
+    STATS_SET(stats->writer_queued, __atomic_load_n(&writer.queued, __ATOMIC_RELAXED));
+    STATS_SET(stats->writer_dropped, writer.dropped);
   }
 
-  if(total > 0)
+  for(i=0; i<RX_LINES; ++i)
   {
-    fwrite((char*)buffer, 1, total, file);
+    if(readers[i].started)
+    {
+      pthread_join(readers[i].thread, NULL);
+    }
+    // nothing else will be queued
+    readers[i].watermark = UINT64_MAX;
   }
 
+  merge_packets();
+
   pcapwriter_close();
 
-  serial_close(fd1);
-  serial_close(fd2);
+  tap_close();
+
+  flight_close();
+
+  ds4_print();
+
+  l2cap_print();
+
+  if(corr.period || corr.skew_samples)
+  {
+    corr_print();
+  }
+
+  log_close();
+
+  print_stats();
+
+  stats_close();
+
+  for(i=0; i<RX_LINES; ++i)
+  {
+    if(readers[i].fd >= 0)
+    {
+      serial_close(readers[i].fd);
+    }
+  }
+
+  if(monitor.fd >= 0)
+  {
+    close(monitor.fd);
+  }
+
+  close(merge.event);
 
   return 0;
 }